@@ -46,6 +46,11 @@
 #include <grp.h>
 #include <ftw.h>
 #include <limits.h>
+#include <math.h>
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "acltool.h"
 #include "range.h"
@@ -218,6 +223,44 @@ typedef struct {
 } DACL;
 
 
+/*
+ * Replace the directory and file ACLs with prepared ones, so they are
+ * only normalized and encoded once instead of for every object.
+ */
+static int
+_dacl_prepare(DACL *a,
+	      const char *name) {
+  gacl_t pda, pfa = NULL;
+
+
+  pda = prepare_acl(name, a->da, S_IFDIR);
+  if (pda)
+    pfa = prepare_acl(name, a->fa, S_IFREG);
+
+  gacl_free(a->da);
+  gacl_free(a->fa);
+  a->da = pda;
+  a->fa = pfa;
+  if (!pfa) {
+    gacl_free(pda);
+    a->da = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns 1 if an object already has a prepared ACL and need not be updated */
+static int
+_dacl_same(const char *path,
+	   const struct stat *sp,
+	   gacl_t ap) {
+  if (config.f_force || config.f_print > 1 || S_ISLNK(sp->st_mode))
+    return 0;
+
+  return vfs_acl_match_file(path, GACL_TYPE_NFS4, ap) == 1;
+}
+
+
 static int
 walker_set(const char *path,
 	   const struct stat *sp,
@@ -226,18 +269,22 @@ walker_set(const char *path,
 	   void *vp) {
   int rc;
   DACL *a = (DACL *) vp;
+  gacl_t ap;
 
   
-  if (S_ISDIR(sp->st_mode))
-    rc = set_acl(path, sp, a->da, NULL);
-  else
-    rc = set_acl(path, sp, a->fa, NULL);
+  /* Prepared (normalized and encoded) by _dacl_prepare() */
+  ap = (S_ISDIR(sp->st_mode) ? a->da : a->fa);
+
+  /* Most objects already have it when rerun, just compare the raw ACLs */
+  if (_dacl_same(path, sp, ap))
+    return 0;
+
+  rc = set_prepared_acl(path, sp, ap, NULL);
   
   if (rc < 0) {
-    if (config.f_ignore)
-      return 0;
-    
-    return 1;
+    /* Only returns with --ignore-errors */
+    error(1, errno, "%s: Setting ACL", path);
+    return 0;
   }
 
   return 0;
@@ -274,12 +321,14 @@ walker_find(const char *path,
 
       if (rc > 0) {
 	/* Found a match */
+	flockfile(stdout);
 	if (config.f_verbose)
 	  print_acl(stdout, ap, path, sp, 0);
 	else
 	  puts(path);
 	
 	w_c++;
+	funlockfile(stdout);
 	return 0;
       }
     }
@@ -306,14 +355,8 @@ walker_print(const char *path,
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
 
-  ++*np;
-  print_acl(fp, ap, path, sp, np ? *np : 0);
-
-  if (ap)
-    gacl_free(ap);
-  
-  ++w_c;
-  
+  /* Hands over ap */
+  print_acl_queue(fp, ap, path, sp, np);
   return 0;
 }
 
@@ -322,8 +365,22 @@ walker_print(const char *path,
 int
 list_cmd(int argc,
 	    char **argv) {
-  int n = 0;
-  return aclcmd_foreach(argc-1, argv+1, walker_print, &n);
+  jmp_buf saved_error_env;
+  int n = 0, rc;
+
+  
+  if (config.format_threads > 0)
+    print_acl_start(stdout, config.format_threads);
+
+  if ((rc = error_catch(saved_error_env)) != 0) {
+    /* Output what has been done so far */
+    print_acl_end();
+    error_return(rc, saved_error_env);
+  }
+
+  rc = aclcmd_foreach(argc-1, argv+1, walker_print, &n);
+  print_acl_end();
+  error_return(rc, saved_error_env);
 }
 
 int
@@ -412,6 +469,9 @@ copy_cmd(int argc,
  
   _acl_filter_file(a.fa);
 
+  if (_dacl_prepare(&a, argv[1]) < 0)
+    return 1;
+
   rc = aclcmd_foreach(argc-2, argv+2, walker_set, (void *) &a);
   
   gacl_free(a.da);
@@ -469,6 +529,9 @@ set_cmd(int argc,
   
   _acl_filter_file(a.fa);
 
+  if (_dacl_prepare(&a, argv[1]) < 0)
+    return 1;
+
   rc = aclcmd_foreach(argc-2, argv+2, walker_set, (void *) &a);
 
   gacl_free(a.da);
@@ -605,6 +668,244 @@ find_cmd(int argc,
 }
 
 
+/*
+ * Survey of the ACLs in a tree. Each object counts with its sampling
+ * weight (1 unless --sample or --sample-per-dir is used), giving unbiased
+ * estimates of the totals. For independent (Poisson) sampling the
+ * variance of such an estimate is the sum of w*(w-1) over the objects
+ * counted, which gives the confidence intervals.
+ */
+typedef struct survey_est {
+  double y;
+  double v;
+  size_t n;
+} SURVEY_EST;
+
+typedef struct survey_principal {
+  struct survey_principal *next;
+  SURVEY_EST e;
+  char name[1];
+} SURVEY_PRINCIPAL;
+
+#define SURVEY_HASH_SIZE 1024
+#define SURVEY_TOP 20
+
+typedef struct survey {
+#if HAVE_PTHREAD_H
+  pthread_mutex_t mtx;
+#endif
+  SURVEY_EST objects;
+  SURVEY_EST files;
+  SURVEY_EST dirs;
+  SURVEY_EST nontrivial;
+  size_t np;
+  SURVEY_PRINCIPAL *hash[SURVEY_HASH_SIZE];
+} SURVEY;
+
+
+static void
+_survey_add(SURVEY_EST *ep,
+	    double w) {
+  ep->y += w;
+  ep->v += w*(w-1);
+  ep->n++;
+}
+
+static int
+_survey_principal(SURVEY *sp,
+		  const char *name,
+		  size_t len,
+		  double w) {
+  SURVEY_PRINCIPAL *pp;
+  size_t i, h = 2166136261U;
+
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char) name[i]) * 16777619U;
+  h &= SURVEY_HASH_SIZE-1;
+
+  for (pp = sp->hash[h]; pp; pp = pp->next)
+    if (strncmp(pp->name, name, len) == 0 && !pp->name[len])
+      break;
+
+  if (!pp) {
+    pp = calloc(1, sizeof(*pp)+len);
+    if (!pp)
+      return -1;
+    memcpy(pp->name, name, len);
+    pp->next = sp->hash[h];
+    sp->hash[h] = pp;
+    sp->np++;
+  }
+
+  _survey_add(&pp->e, w);
+  return 0;
+}
+
+static int
+walker_survey(const char *path,
+	      const struct stat *sp,
+	      size_t base,
+	      size_t level,
+	      void *vp) {
+  SURVEY *svp = (SURVEY *) vp;
+  gacl_t ap = NULL;
+  gacl_entry_t ae;
+  char names[64][80];
+  int i, j, k, n, rc, tf = 1;
+  double w = ft_sample_weight();
+
+
+  rc = get_acl(path, sp, &ap);
+  if (rc < 0)
+    return error(1, errno, "%s: Getting ACL", path);
+
+  /* Principals (the part of the entries before the permissions) */
+  n = 0;
+  if (rc > 0) {
+    if (gacl_is_trivial_np(ap, &tf) < 0)
+      tf = 1;
+
+    for (i = 0; n < 64 && gacl_get_entry(ap, i == 0 ? GACL_FIRST_ENTRY : GACL_NEXT_ENTRY, &ae) == 1; i++) {
+      char *cp;
+
+      if (!ace2str(ae, names[n], sizeof(names[n])))
+	continue;
+
+      cp = strchr(names[n], ':');
+      if (cp && (strncmp(names[n], "u:", 2) == 0 || strncmp(names[n], "g:", 2) == 0))
+	cp = strchr(cp+1, ':');
+      if (cp)
+	*cp = '\0';
+
+      /* Count each principal once per object */
+      for (j = 0; j < n && strcmp(names[j], names[n]) != 0; j++)
+	;
+      if (j == n)
+	n++;
+    }
+    gacl_free(ap);
+  }
+
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&svp->mtx);
+#endif
+  _survey_add(&svp->objects, w);
+  _survey_add(S_ISDIR(sp->st_mode) ? &svp->dirs : &svp->files, w);
+  if (!tf)
+    _survey_add(&svp->nontrivial, w);
+  rc = 0;
+  for (k = 0; rc == 0 && k < n; k++)
+    rc = _survey_principal(svp, names[k], strlen(names[k]), w);
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&svp->mtx);
+#endif
+
+  if (rc < 0)
+    return error(1, errno, "%s: Survey", path);
+  return 0;
+}
+
+static void
+_survey_print(const char *label,
+	      const SURVEY_EST *ep,
+	      const SURVEY_EST *tp) {
+  printf("  %-20s  %12.0f", label, ep->y);
+  if (ep->v > 0)
+    printf(" +/- %-10.0f", 1.96*sqrt(ep->v));
+  else
+    printf("               ");
+  if (tp && tp->y > 0)
+    printf("  %5.1f%%", 100.0*ep->y/tp->y);
+  putchar('\n');
+}
+
+static int
+_survey_compare(const void *a,
+		const void *b) {
+  const SURVEY_PRINCIPAL *x = * (const SURVEY_PRINCIPAL **) a;
+  const SURVEY_PRINCIPAL *y = * (const SURVEY_PRINCIPAL **) b;
+
+  if (x->e.y != y->e.y)
+    return x->e.y > y->e.y ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+static void
+_survey_report(SURVEY *sp) {
+  SURVEY_PRINCIPAL *pp, **pv;
+  size_t i, j;
+
+
+  if (config.sample > 0 || config.sample_per_dir > 0)
+    printf("Estimates (95%% confidence) from %lu sampled objects:\n",
+	   (unsigned long) sp->objects.n);
+  else
+    printf("Totals:\n");
+  _survey_print("Objects", &sp->objects, NULL);
+  _survey_print("Directories", &sp->dirs, &sp->objects);
+  _survey_print("Files", &sp->files, &sp->objects);
+  _survey_print("Non-trivial ACLs", &sp->nontrivial, &sp->objects);
+
+  if (sp->np == 0 || (pv = malloc(sp->np * sizeof(pv[0]))) == NULL)
+    return;
+
+  for (i = j = 0; i < SURVEY_HASH_SIZE; i++)
+    for (pp = sp->hash[i]; pp; pp = pp->next)
+      pv[j++] = pp;
+  qsort(pv, j, sizeof(pv[0]), _survey_compare);
+
+  printf("Principals (objects with entries for):\n");
+  for (i = 0; i < j && (config.f_verbose || i < SURVEY_TOP); i++)
+    _survey_print(pv[i]->name, &pv[i]->e, &sp->objects);
+  if (i < j)
+    printf("  (%lu more, use -v to list all)\n", (unsigned long) (j-i));
+  free(pv);
+}
+
+static void
+_survey_free(SURVEY *sp) {
+  SURVEY_PRINCIPAL *pp, *npp;
+  size_t i;
+
+
+  for (i = 0; i < SURVEY_HASH_SIZE; i++) {
+    for (pp = sp->hash[i]; pp; pp = npp) {
+      npp = pp->next;
+      free(pp);
+    }
+    sp->hash[i] = NULL;
+  }
+#if HAVE_PTHREAD_H
+  pthread_mutex_destroy(&sp->mtx);
+#endif
+}
+
+int
+survey_cmd(int argc,
+	   char **argv) {
+  jmp_buf saved_error_env;
+  SURVEY sv;
+  int rc;
+
+
+  memset(&sv, 0, sizeof(sv));
+#if HAVE_PTHREAD_H
+  pthread_mutex_init(&sv.mtx, NULL);
+#endif
+
+  if ((rc = error_catch(saved_error_env)) != 0) {
+    _survey_free(&sv);
+    error_return(rc, saved_error_env);
+  }
+
+  rc = aclcmd_foreach(argc-1, argv+1, walker_survey, (void *) &sv);
+  _survey_report(&sv);
+  _survey_free(&sv);
+  error_return(rc, saved_error_env);
+}
+
+
 
 
 static int
@@ -676,10 +977,17 @@ walker_inherit(const char *path,
     if (_acl_filter_file(a->fa) < 0)
       goto Fail;
     
+    if (_dacl_prepare(a, path) < 0)
+      return -1;
+    
     return 0;
   } else {
-    int rc;
-    gacl_t oap;
+    int rc, s_errno;
+    gacl_t oap, nap;
+    
+    nap = (S_ISDIR(sp->st_mode) ? a->da : a->fa);
+    if (_dacl_same(path, sp, nap))
+      return 0;
     
     rc = get_acl(path, sp, &oap);
     if (rc < 0)
@@ -687,14 +995,12 @@ walker_inherit(const char *path,
     if (rc == 0)
       return 0;
     
-    if (S_ISDIR(sp->st_mode))
-      rc = set_acl(path, sp, a->da, oap);
-    else
-      rc = set_acl(path, sp, a->fa, oap);
+    rc = set_prepared_acl(path, sp, nap, oap);
+    s_errno = errno;
+    gacl_free(oap);
     if (rc < 0)
-      return error(1, errno, "%s: Setting ACL", path);
+      return error(1, s_errno, "%s: Setting ACL", path);
     
-    gacl_free(oap);
     return 0;
   }
 
@@ -786,6 +1092,9 @@ COMMAND delete_command =
 COMMAND find_command =
   { "find-access",      find_cmd,	NULL, "<acl> <path>+",		"Search ACL(s)" };
 
+COMMAND survey_command =
+  { "survey-access",    survey_cmd,	NULL, "<path>+",		"Survey ACL(s) (see --sample)" };
+
 COMMAND rename_command =
   { "rename-access",    rename_cmd,     NULL, "<new>=<old>[,...] <path>+", 	"Rename ACL entries" };
 
@@ -807,6 +1116,7 @@ COMMAND *acl_commands[] =
    &copy_command,
    &delete_command,
    &find_command,
+   &survey_command,
    &rename_command,
    &inherit_command,
    NULL,
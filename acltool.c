@@ -39,6 +39,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <pwd.h>
 #include <grp.h>
 #include <ftw.h>
@@ -57,6 +58,7 @@
 #endif
 
 #include "acltool.h"
+#include "ids.h"
 
 #if HAVE_LIBSMBCLIENT
 #include "smb.h"
@@ -255,6 +257,172 @@ set_depth(const char *name,
   return 0;
 }
 
+int
+set_jobs(const char *name,
+	 const char *value,
+	 unsigned int type,
+	 const void *svp,
+	 void *dvp,
+	 const char *a0) {
+  if (svp)
+    config.jobs = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+set_min_jobs(const char *name,
+	     const char *value,
+	     unsigned int type,
+	     const void *svp,
+	     void *dvp,
+	     const char *a0) {
+  if (svp)
+    config.min_jobs = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+set_max_ops(const char *name,
+	    const char *value,
+	    unsigned int type,
+	    const void *svp,
+	    void *dvp,
+	    const char *a0) {
+  if (svp)
+    config.max_ops = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+set_max_writes(const char *name,
+	       const char *value,
+	       unsigned int type,
+	       const void *svp,
+	       void *dvp,
+	       const char *a0) {
+  if (svp)
+    config.max_writes = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+set_max_jobs(const char *name,
+	     const char *value,
+	     unsigned int type,
+	     const void *svp,
+	     void *dvp,
+	     const char *a0) {
+  if (svp)
+    config.max_jobs = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+set_prefetch(const char *name,
+	     const char *value,
+	     unsigned int type,
+	     const void *svp,
+	     void *dvp,
+	     const char *a0) {
+  if (svp)
+    config.prefetch = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+set_format_threads(const char *name,
+		   const char *value,
+		   unsigned int type,
+		   const void *svp,
+		   void *dvp,
+		   const char *a0) {
+  if (svp)
+    config.format_threads = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+int
+set_io_uring(const char *name,
+	     const char *value,
+	     unsigned int type,
+	     const void *svp,
+	     void *dvp,
+	     const char *a0) {
+  config.f_uring = 1;
+  return 0;
+}
+
+int
+set_max_memory(const char *name,
+	       const char *value,
+	       unsigned int type,
+	       const void *svp,
+	       void *dvp,
+	       const char *a0) {
+  unsigned long v;
+  char *ep;
+
+  
+  if (!value)
+    return -1;
+
+  errno = 0;
+  v = strtoul(value, &ep, 10);
+  if (errno)
+    goto Fail;
+  switch (toupper(*ep)) {
+  case 'G':
+    if (v > ULONG_MAX/1024)
+      goto Overflow;
+    v *= 1024;
+    /* FALLTHROUGH */
+  case 'M':
+    if (v > ULONG_MAX/1024)
+      goto Overflow;
+    v *= 1024;
+    /* FALLTHROUGH */
+  case 'K':
+    if (v > ULONG_MAX/1024)
+      goto Overflow;
+    v *= 1024;
+    ++ep;
+  }
+  if (ep == value || *ep || value[strspn(value, " \t")] == '-') {
+    errno = EINVAL;
+    goto Fail;
+  }
+
+  config.max_memory = v;
+  return 0;
+
+ Overflow:
+  errno = ERANGE;
+ Fail:
+  fprintf(stderr, "%s: Error: %s: Invalid memory size: %s\n", a0, value, strerror(errno));
+  return -1;
+}
+
 int
 set_style(const char *name,
 	  const char *value,
@@ -309,6 +477,323 @@ set_no_prefix(const char *name,
   return 0;
 }
 
+int
+set_dedup(const char *name,
+	  const char *value,
+	  unsigned int type,
+	  const void *svp,
+	  void *dvp,
+	  const char *a0) {
+  config.f_dedup = 1;
+  return 0;
+}
+
+int
+set_one_filesystem(const char *name,
+		   const char *value,
+		   unsigned int type,
+		   const void *svp,
+		   void *dvp,
+		   const char *a0) {
+  config.f_xdev = 1;
+  return 0;
+}
+
+int
+set_prune_fstype(const char *name,
+		 const char *value,
+		 unsigned int type,
+		 const void *svp,
+		 void *dvp,
+		 const char *a0) {
+  char *cp;
+
+  
+  if (!value)
+    return -1;
+
+  /* May be repeated, collect into a comma separated list */
+  if (config.prune_fstypes)
+    cp = s_dupcat(config.prune_fstypes, ",", value, NULL);
+  else
+    cp = strdup(value);
+  if (!cp)
+    return -1;
+
+  /* The default configuration's string is shared, only free our own */
+  if (config.prune_fstypes != default_config.prune_fstypes)
+    free(config.prune_fstypes);
+
+  config.prune_fstypes = cp;
+  return 0;
+}
+
+/*
+ * Add patterns to a list in the configuration. A new list is created
+ * so the one in the default configuration is left untouched.
+ */
+static int
+add_patterns(SLIST **spp,
+	     SLIST *dsp,
+	     char **pv,
+	     size_t pc) {
+  SLIST *np;
+  size_t i;
+
+
+  np = slist_new((*spp ? (*spp)->c : 0)+pc+1);
+  if (!np)
+    return -1;
+
+  for (i = 0; *spp && i < (*spp)->c; i++)
+    if (slist_add(np, (*spp)->v[i]) < 0)
+      goto Fail;
+  for (i = 0; i < pc; i++)
+    if (slist_add(np, pv[i]) < 0)
+      goto Fail;
+
+  if (*spp && *spp != dsp)
+    slist_free(*spp);
+  *spp = np;
+  return 0;
+
+ Fail:
+  slist_free(np);
+  return -1;
+}
+
+int
+set_exclude(const char *name,
+	    const char *value,
+	    unsigned int type,
+	    const void *svp,
+	    void *dvp,
+	    const char *a0) {
+  if (!value)
+    return -1;
+
+  return add_patterns(&config.exclude, default_config.exclude, (char **) &value, 1);
+}
+
+int
+set_exclude_from(const char *name,
+		 const char *value,
+		 unsigned int type,
+		 const void *svp,
+		 void *dvp,
+		 const char *a0) {
+  FILE *fp;
+  SLIST *pl;
+  char buf[2048];
+  int rc;
+
+
+  if (!value)
+    return -1;
+
+  fp = fopen(value, "r");
+  if (!fp) {
+    fprintf(stderr, "%s: Error: %s: Opening: %s\n", a0, value, strerror(errno));
+    return -1;
+  }
+
+  pl = slist_new(64);
+  if (!pl) {
+    fclose(fp);
+    return -1;
+  }
+
+  /* One pattern per line, empty lines and lines starting with '#' are ignored */
+  while (fgets(buf, sizeof(buf), fp)) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    if (!buf[0] || buf[0] == '#')
+      continue;
+    if (slist_add(pl, buf) < 0) {
+      slist_free(pl);
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+
+  rc = add_patterns(&config.exclude, default_config.exclude, pl->v, pl->c);
+  slist_free(pl);
+  return rc;
+}
+
+int
+set_prune(const char *name,
+	  const char *value,
+	  unsigned int type,
+	  const void *svp,
+	  void *dvp,
+	  const char *a0) {
+  if (!value)
+    return -1;
+
+  return add_patterns(&config.prune, default_config.prune, (char **) &value, 1);
+}
+
+int
+set_from(const char *name,
+	 const char *value,
+	 unsigned int type,
+	 const void *svp,
+	 void *dvp,
+	 const char *a0) {
+  if (!value)
+    return -1;
+
+  /* The default configuration's string is shared, only free our own */
+  if (config.from != default_config.from)
+    free(config.from);
+
+  config.from = strdup(value);
+  return config.from ? 0 : -1;
+}
+
+int
+set_changed_since(const char *name,
+		  const char *value,
+		  unsigned int type,
+		  const void *svp,
+		  void *dvp,
+		  const char *a0) {
+  if (!value)
+    return -1;
+
+  /* The default configuration's string is shared, only free our own */
+  if (config.changed_since != default_config.changed_since)
+    free(config.changed_since);
+
+  config.changed_since = strdup(value);
+  return config.changed_since ? 0 : -1;
+}
+
+/* <rate>[%][,<seed>] */
+int
+set_sample(const char *name,
+	   const char *value,
+	   unsigned int type,
+	   const void *svp,
+	   void *dvp,
+	   const char *a0) {
+  double v;
+  char *ep;
+
+
+  if (!value)
+    return -1;
+
+  v = strtod(value, &ep);
+  if (*ep == '%') {
+    v /= 100;
+    ++ep;
+  }
+  if (ep == value || v <= 0 || v > 1)
+    return -1;
+
+  if (*ep == ',') {
+    char *sp = ep+1;
+
+    config.sample_seed = strtoul(sp, &ep, 0);
+    if (ep == sp)
+      return -1;
+  }
+  if (*ep)
+    return -1;
+
+  config.sample = v;
+  return 0;
+}
+
+int
+set_sample_per_dir(const char *name,
+		   const char *value,
+		   unsigned int type,
+		   const void *svp,
+		   void *dvp,
+		   const char *a0) {
+  if (svp)
+    config.sample_per_dir = * (int *) svp;
+  else
+    return -1;
+
+  return 0;
+}
+
+/* [<passwd-file>][,<group-file>] */
+int
+set_preload_ids(const char *name,
+		const char *value,
+		unsigned int type,
+		const void *svp,
+		void *dvp,
+		const char *a0) {
+  /* The default configuration's string is shared, only free our own */
+  if (config.preload_ids != default_config.preload_ids)
+    free(config.preload_ids);
+
+  config.preload_ids = strdup(value ? value : "");
+  if (!config.preload_ids)
+    return -1;
+
+  /* Load now, ACLs given as arguments are parsed before the walk starts */
+  if (ids_preload(config.preload_ids) < 0) {
+    fprintf(stderr, "%s: Error: %s: Preloading users and groups: %s\n",
+	    a0, *config.preload_ids ? config.preload_ids : "NSS", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int
+set_checkpoint(const char *name,
+	       const char *value,
+	       unsigned int type,
+	       const void *svp,
+	       void *dvp,
+	       const char *a0) {
+  if (!value)
+    return -1;
+
+  /* The default configuration's string is shared, only free our own */
+  if (config.checkpoint != default_config.checkpoint)
+    free(config.checkpoint);
+
+  config.checkpoint = strdup(value);
+  return config.checkpoint ? 0 : -1;
+}
+
+int
+set_resume(const char *name,
+	   const char *value,
+	   unsigned int type,
+	   const void *svp,
+	   void *dvp,
+	   const char *a0) {
+  if (!value)
+    return -1;
+
+  /* The default configuration's string is shared, only free our own */
+  if (config.resume != default_config.resume)
+    free(config.resume);
+
+  config.resume = strdup(value);
+  return config.resume ? 0 : -1;
+}
+
+int
+set_inode_order(const char *name,
+		const char *value,
+		unsigned int type,
+		const void *svp,
+		void *dvp,
+		const char *a0) {
+  config.f_inodeorder = 1;
+  return 0;
+}
+
 extern OPTION global_options[];
 
 
@@ -338,7 +823,36 @@ OPTION global_options[] =
    { "merge",     	'm', OPTS_TYPE_NONE,               set_merge,     NULL, "Merge redundant ACL entries" },
    { "relaxed",      	'R', OPTS_TYPE_NONE,               set_relaxed,   NULL, "Relaxed mode" },
    { "recurse",   	'r', OPTS_TYPE_INT|OPTS_TYPE_OPT,  set_recurse,   NULL, "Enable recursion" },
+#if HAVE_PTHREAD_H
+   { "min-jobs",  	'q', OPTS_TYPE_UINT,               set_min_jobs,  NULL, "Min operations in flight (adaptive)" },
+   { "max-jobs",  	'Q', OPTS_TYPE_UINT,               set_max_jobs,  NULL, "Max operations in flight (adaptive)" },
+#endif
+   { "max-ops-per-sec", 'O', OPTS_TYPE_UINT,               set_max_ops,   NULL, "Max metadata operations per second" },
+   { "max-writes-per-sec", 'W', OPTS_TYPE_UINT,            set_max_writes, NULL, "Max ACL updates per second" },
    { "depth",     	'd', OPTS_TYPE_INT|OPTS_TYPE_OPT,  set_depth,     NULL, "Increase/decrease max depth" },
+   { "inode-order", 	'I', OPTS_TYPE_NONE,               set_inode_order, NULL, "Process directory entries in inode order" },
+   { "max-memory",  	'M', OPTS_TYPE_STR,                set_max_memory, NULL, "Memory limit for tree walk queues" },
+   { "dedup-links", 	'L', OPTS_TYPE_NONE,               set_dedup,     NULL, "Process hard linked files only once" },
+   { "one-filesystem", 	'x', OPTS_TYPE_NONE,               set_one_filesystem, NULL, "Do not descend into other filesystems" },
+   { "prune-fstype", 	'F', OPTS_TYPE_STR,                set_prune_fstype, NULL, "Do not descend into filesystems of type" },
+   { "exclude",     	'K', OPTS_TYPE_STR,                set_exclude,   NULL, "Skip objects matching pattern" },
+   { "exclude-from", 	'k', OPTS_TYPE_STR,                set_exclude_from, NULL, "Skip objects matching patterns in file" },
+   { "prune",       	'Y', OPTS_TYPE_STR,                set_prune,     NULL, "Do not descend into directories matching pattern" },
+   { "from",        	'l', OPTS_TYPE_STR,                set_from,      NULL, "Read paths to operate on from file (- for stdin)" },
+   { "changed-since", 	'c', OPTS_TYPE_STR,                set_changed_since, NULL, "Only operate on objects changed since time or state file" },
+   { "sample",      	'y', OPTS_TYPE_STR,                set_sample,    NULL, "Only visit a random sample (rate[%][,seed]) of the objects" },
+   { "sample-per-dir", 	'z', OPTS_TYPE_UINT,               set_sample_per_dir, NULL, "Only visit a random sample of about N objects per directory" },
+   { "preload-ids", 	'G', OPTS_TYPE_STR|OPTS_TYPE_OPT,  set_preload_ids, NULL, "Load all users and groups (from NSS or passwd[,group] files) at start" },
+   { "checkpoint",  	'C', OPTS_TYPE_STR,                set_checkpoint, NULL, "Save tree walk progress to file" },
+   { "resume",      	'Z', OPTS_TYPE_STR,                set_resume,    NULL, "Resume tree walk from checkpoint file" },
+#if HAVE_PTHREAD_H
+   { "jobs",      	'j', OPTS_TYPE_UINT,               set_jobs,      NULL, "Number of parallel walker threads" },
+   { "prefetch",  	'a', OPTS_TYPE_UINT,               set_prefetch,  NULL, "Number of metadata prefetch threads" },
+   { "format-threads", 'T', OPTS_TYPE_UINT,               set_format_threads, NULL, "Number of ACL formatting threads" },
+#endif
+#if HAVE_LINUX_IO_URING_H
+   { "io-uring",  	'U', OPTS_TYPE_NONE,               set_io_uring,  NULL, "Batch metadata lookups using io_uring" },
+#endif
    { "style",     	'S', OPTS_TYPE_STR,                set_style,     NULL, "Select ACL print style" },
    { "type",      	't', OPTS_TYPE_STR,                set_filetype,  NULL, "File types to operate on" },
 #if HAVE_LIBSMBCLIENT
@@ -367,6 +881,24 @@ cfg_parse(CONFIG *cfgp,
   return 0;
 }
 
+/*
+ * Check option combinations that no single option handler can, since
+ * the options may be given in any order. Called after all options for
+ * a command have been parsed.
+ */
+int
+cfg_check(const char *a0) {
+  /* --min-jobs only makes sense together with a larger --max-jobs */
+  if (config.min_jobs > 1 && config.max_jobs < config.min_jobs) {
+    fprintf(stderr, "%s: Error: --min-jobs=%d: Requires --max-jobs of at least %d\n",
+	    a0, config.min_jobs, config.min_jobs);
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
 
 void
 print_version(void) {
@@ -410,6 +942,55 @@ config_cmd(int argc,
       printf("  Recurse Max Depth:  No Limit\n");
     else
       printf("  Recurse Max Depth:  %d\n", config.max_depth);
+    printf("  Inode Order:        %s\n", config.f_inodeorder ? "Yes" : "No");
+    printf("  Parallel Jobs:      %d\n", config.jobs > 1 ? config.jobs : 1);
+    if (config.max_jobs > 1)
+      printf("  Adaptive Jobs:      %d-%d\n", config.min_jobs > 1 ? config.min_jobs : 1, config.max_jobs);
+    else
+      printf("  Adaptive Jobs:      No\n");
+    if (config.max_ops)
+      printf("  Max Ops/Second:     %d\n", config.max_ops);
+    else
+      printf("  Max Ops/Second:     No Limit\n");
+    if (config.max_writes)
+      printf("  Max Writes/Second:  %d\n", config.max_writes);
+    else
+      printf("  Max Writes/Second:  No Limit\n");
+    printf("  Prefetch Threads:   %d\n", config.prefetch);
+    printf("  Format Threads:     %d\n", config.format_threads);
+    printf("  Use io_uring:       %s\n", config.f_uring ? "Yes" : "No");
+    printf("  Max Memory:         %luK\n",
+	   (unsigned long) (config.max_memory ? config.max_memory : FT_MEMORY_LIMIT)/1024);
+    printf("  Dedup Hard Links:   %s\n", config.f_dedup ? "Yes" : "No");
+    printf("  One Filesystem:     %s\n", config.f_xdev ? "Yes" : "No");
+    printf("  Prune FS Types:     %s\n", config.prune_fstypes ? config.prune_fstypes : "-");
+    if (config.exclude) {
+      char *cp = slist_join(config.exclude, " ");
+
+      printf("  Exclude:            %s\n", cp ? cp : "?");
+      free(cp);
+    } else
+      printf("  Exclude:            -\n");
+    if (config.prune) {
+      char *cp = slist_join(config.prune, " ");
+
+      printf("  Prune:              %s\n", cp ? cp : "?");
+      free(cp);
+    } else
+      printf("  Prune:              -\n");
+    printf("  Path List:          %s\n", config.from ? config.from : "-");
+    printf("  Changed Since:      %s\n", config.changed_since ? config.changed_since : "-");
+    if (config.sample > 0)
+      printf("  Sample:             %g%% (seed %lu)\n", config.sample*100, config.sample_seed);
+    else
+      printf("  Sample:             No\n");
+    printf("  Sample Per Dir:     %d\n", config.sample_per_dir);
+    if (config.preload_ids)
+      printf("  Preload IDs:        %s\n", *config.preload_ids ? config.preload_ids : "NSS");
+    else
+      printf("  Preload IDs:        No\n");
+    printf("  Checkpoint File:    %s\n", config.checkpoint ? config.checkpoint : "-");
+    printf("  Resume File:        %s\n", config.resume ? config.resume : "-");
     printf("  Print Level:        %d\n", config.f_print);
     printf("  Update:             %s\n", config.f_noupdate ? "No" : "Yes");
     printf("  Prefix:             %s\n", config.f_noprefix ? "No" : "Yes");
@@ -593,6 +1174,11 @@ run_cmd(int argc,
   
 
   config = default_config;
+  (void) ids_preload(config.preload_ids);
+
+  /* The previous command may have been aborted half way */
+  ft_reset();
+
   rc = cmd_run(&commands, argc, argv);
   if (rc > 0)
     error(rc, errno, "%s", argv[0]);
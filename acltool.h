@@ -65,10 +65,33 @@ typedef struct config {
   int f_relaxed;
   int f_noupdate;
   int f_noprefix;
+  int f_inodeorder;
+  int f_dedup;
+  int f_xdev;
+  int f_uring;
   mode_t f_filetype;
   GACL_STYLE f_style;
   
   int max_depth;
+  int jobs;
+  int min_jobs;
+  int max_jobs;
+  int max_ops;
+  int max_writes;
+  double sample;
+  int sample_per_dir;
+  unsigned long sample_seed;
+  char *preload_ids;
+  int prefetch;
+  int format_threads;
+  size_t max_memory;
+  char *checkpoint;
+  char *resume;
+  char *prune_fstypes;
+  SLIST *exclude;
+  SLIST *prune;
+  char *from;
+  char *changed_since;
 } CONFIG;
 
 
@@ -82,6 +105,9 @@ extern CONFIG default_config;
 /* Per-command active configuration */
 extern CONFIG config;
 
+extern int
+cfg_check(const char *a0);
+
 extern int
 error(int rc, int ec, const char *msg, ...);
 
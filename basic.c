@@ -89,8 +89,8 @@ int
 dir_cmd(int argc,
 	char **argv) {
   VFS_DIR *vdp;
-  struct dirent *dep;
-  int i, j;
+  VFS_DIRENT dv[256];
+  int i, j, n;
   
   
   for (i = 1; i < argc || (i == 1 && argc == 1); i++) {
@@ -109,8 +109,9 @@ dir_cmd(int argc,
     if (!nlist)
       error(1, errno, "Memory allocation failure");
     
-    while ((dep = vfs_readdir(vdp)) != NULL)
-      slist_add(nlist, dep->d_name);
+    while ((n = vfs_readdir_batch(vdp, dv, sizeof(dv)/sizeof(dv[0]))) > 0)
+      for (j = 0; j < n; j++)
+	slist_add(nlist, (char *) dv[j].d_name);
     vfs_closedir(vdp);
 
     qsort(&nlist->v[0], nlist->c, sizeof(nlist->v[0]), _dirname_compare);
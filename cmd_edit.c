@@ -777,8 +777,10 @@ walker_edit(const char *path,
 	    size_t base,
 	    size_t level,
 	    void *vp) {
-  gacl_t oap = NULL;
-  gacl_t nap = NULL;
+  /* Changed after error_catch() (nap may move when it grows) and freed there */
+  gacl_t volatile oap = NULL;
+  gacl_t volatile nap = NULL;
+  gacl_t ap;
   SCRIPT *script = NULL;
   int rc = 0;
   int pos = 0;
@@ -795,7 +797,9 @@ walker_edit(const char *path,
     error_return(rc, saved_error_env);
   }
   
-  rc = get_acl(path, sp, &oap);  
+  ap = NULL;
+  rc = get_acl(path, sp, &ap);
+  oap = ap;
   if (rc < 0)
     return error(1, errno, "%s: Getting ACL", path);
   if (rc == 0)
@@ -866,28 +870,30 @@ walker_edit(const char *path,
 	    if (p == RANGE_END)
 	      p = nap->ac-1;
 
+	    flockfile(stdout);
 	    if (!config.f_noprefix)
 	      printf("%-20s\t", path);
 	    if (p_line)
 	      printf("%-4d\t", p);
-	    if (print_ace(nap, p, GACL_TEXT_STANDARD) < 0) {
-	      rc = -1;
+	    rc = print_ace(nap, p, GACL_TEXT_STANDARD);
+	    funlockfile(stdout);
+	    if (rc < 0)
 	      break;
-	    }
 	    
 	    if (p >= nap->ac-1)
 	      break;
 	  }
 	  pos = p;
 	} else {
+	  flockfile(stdout);
 	  if (!config.f_noprefix)
 	    printf("%-20s\t", path);
 	  if (p_line)
 	    printf("%-4d\t", pos);
-	  if (print_ace(nap, pos, GACL_TEXT_STANDARD) < 0) {
-	    rc = -1;
+	  rc = print_ace(nap, pos, GACL_TEXT_STANDARD);
+	  funlockfile(stdout);
+	  if (rc < 0)
 	    break;
-	  }
 	}
 	break;
 	
@@ -897,7 +903,10 @@ walker_edit(const char *path,
 	  p1 = pos;
 	if (cr->cmd == 'a')
 	  ++p1;
-	if (gacl_create_entry_np(&nap, &nae, p1) < 0)
+	ap = nap;
+	rc = gacl_create_entry_np(&ap, &nae, p1);
+	nap = ap;
+	if (rc < 0)
 	  return error(1, errno, "Creating ACL Entry @ %d", p1);
 	else if (gacl_copy_entry(nae, cr->change.ep) < 0)
 	  return error(1, errno, "Copying ACL Entry");
@@ -934,9 +943,9 @@ walker_edit(const char *path,
 	    if (oep->tag.type > nep->tag.type)
 	      continue;
 	    if (oep->tag.type == GACL_TAG_TYPE_USER || oep->tag.type == GACL_TAG_TYPE_GROUP) {
-	      if (oep->tag.ugid < nep->tag.ugid)
+	      if (GACL_TAG_UGID(&oep->tag) < GACL_TAG_UGID(&nep->tag))
 		break;
-	      if (oep->tag.ugid > nep->tag.ugid)
+	      if (GACL_TAG_UGID(&oep->tag) > GACL_TAG_UGID(&nep->tag))
 		break;
 	    }
 	    if (oep->type > nep->type)
@@ -1001,7 +1010,10 @@ walker_edit(const char *path,
 	if (nm == 0) {
 	AddACE:
 	  /* Add ACE entry if no match found */
-	  if (gacl_create_entry_np(&nap, &nae, pos) < 0)
+	  ap = nap;
+	  rc = gacl_create_entry_np(&ap, &nae, pos);
+	  nap = ap;
+	  if (rc < 0)
 	    return error(1, errno, "Creating ACL Entry @ %d", pos);
 
 	  if (gacl_copy_entry(nae, cr->change.ep) < 0)
@@ -184,6 +184,8 @@ cmd_run(COMMANDS *cmdlist,
   
   if (i < 0)
     return i;
+  if (cfg_check(argv0) < 0)
+    return -1;
   for (j = 1; i < argc; i++, j++)
     argv[j] = argv[i];
   argv[j] = NULL;
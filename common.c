@@ -31,6 +31,8 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,8 +47,13 @@
 #include <ftw.h>
 #include <limits.h>
 
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "acltool.h"
 #include "common.h"
+#include "ids.h"
 
 
 #define GACL_CLEAN_BITS_INVALID   0x03
@@ -147,16 +154,21 @@ print_ace(gacl_t ap,
 }
 
 
-int
-set_acl(const char *path,
-	const struct stat *sp,
-	gacl_t nap,
-	gacl_t oap) {
+/*
+ * Clean, strip, sort and merge (as configured) an ACL to be set on an
+ * object of type mode. Returns 0 with *app set to nap or a new ACL, or
+ * what set_acl() should return.
+ */
+static int
+_norm_acl(const char *path,
+	  mode_t mode,
+	  gacl_t nap,
+	  gacl_t *app) {
   int rc, s_errno;
   gacl_t ap = nap;
 
   
-  rc = clean_acl(ap, sp->st_mode, GACL_CLEAN_FAIL_INVALID);
+  rc = clean_acl(ap, mode, GACL_CLEAN_FAIL_INVALID);
   if (rc)
     return error(1, errno, "%s: Cleaning ACL", path);
   
@@ -202,15 +214,66 @@ set_acl(const char *path,
     ap = map;
   }
 
+  *app = ap;
+  return 0;
+}
+
+
+/*
+ * Prepare an ACL to be set with set_prepared_acl() on many objects of
+ * type mode (only the directory bit matters): normalized and encoded
+ * into the native form once. Returns a new ACL or NULL.
+ */
+gacl_t
+prepare_acl(const char *name,
+	    gacl_t nap,
+	    mode_t mode) {
+  gacl_t ap;
+
+
+  if (_norm_acl(name, mode, nap, &ap) != 0)
+    return NULL;
+
+  if (ap == nap) {
+    ap = gacl_dup(nap);
+    if (!ap) {
+      error(1, errno, "%s: Internal Fault (gacl_dup)", name);
+      return NULL;
+    }
+  }
+
+  /* Set as (and compared with) NFSv4 ACLs, ACLs from text have no type */
+  ap->type = GACL_TYPE_NFS4;
+
+  if (gacl_encode_np(ap) < 0) {
+    error(1, errno, "%s: Encoding ACL", name);
+    gacl_free(ap);
+    return NULL;
+  }
+
+  return ap;
+}
+
+
+/*
+ * Set an ACL returned by prepare_acl() (or already normalized) on an
+ * object, unless it already has it (oap). Returns 1 if updated, 0 if not
+ * and -1 (without reporting it) if setting the ACL failed.
+ */
+int
+set_prepared_acl(const char *path,
+		 const struct stat *sp,
+		 gacl_t ap,
+		 gacl_t oap) {
+  int rc;
+
+
   if (config.f_print > 1)
     print_acl(stdout, ap, path, sp, 0);
   
   /* Skip set operation if old and new acl is the same (and force flag not in use) */
-  if (oap && gacl_match(ap, oap) == 1 && !config.f_force) {
-    if (ap != nap)
-      gacl_free(ap);
+  if (oap && gacl_match(ap, oap) == 1 && !config.f_force)
     return 0;
-  }
 
   rc = 0;
   if (!config.f_noupdate) {
@@ -220,13 +283,8 @@ set_acl(const char *path,
       rc = vfs_acl_set_file(path, GACL_TYPE_NFS4, ap);
   }
 
-  if (rc < 0) {
-    s_errno = errno;
-    if (ap != nap)
-      gacl_free(ap);
-    error(1, s_errno, "%s: Setting ACL", path);
+  if (rc < 0)
     return rc;
-  }
 
   if (config.f_print == 1)
     print_acl(stdout, ap, path, sp, 0);
@@ -234,10 +292,31 @@ set_acl(const char *path,
   if (config.f_verbose)
     printf("%s: ACL Updated%s\n", path, (config.f_noupdate ? " (NOT)" : ""));
   
+  return 1;
+}
+
+
+int
+set_acl(const char *path,
+	const struct stat *sp,
+	gacl_t nap,
+	gacl_t oap) {
+  int rc, s_errno;
+  gacl_t ap;
+
+  
+  rc = _norm_acl(path, sp->st_mode, nap, &ap);
+  if (rc)
+    return rc;
+
+  rc = set_prepared_acl(path, sp, ap, oap);
+
+  s_errno = errno;
   if (ap != nap)
     gacl_free(ap);
-
-  return 1;
+  if (rc < 0)
+    error(1, s_errno, "%s: Setting ACL", path);
+  return rc;
 }
 
 
@@ -349,54 +428,54 @@ primos_print_flags(FILE *fp,
 }
 
 
-int
-print_acl(FILE *fp,
-	  gacl_t a,
-	  const char *path,
-	  const struct stat *sp,
-	  int cnt) {
+static int
+_print_acl(FILE *fp,
+	   gacl_t a,
+	   const char *path,
+	   const struct stat *sp,
+	   int cnt) {
   gacl_entry_t ae;
   int i, is_trivial, len;
   uid_t *idp;
   char *as = NULL;
-  char acebuf[2048], ubuf[64], gbuf[64], tbuf[80];
+  char acebuf[2048], ubuf[64], gbuf[64], tbuf[80], cbuf[32];
   char *us = NULL;
   char *gs = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
-  struct tm *tp;
+  const char *un = NULL, *gn = NULL;
+  struct tm *tp, tmb;
   
 
   if (strncmp(path, "./", 2) == 0)
     path += 2;
 
+  /* The id cache is shared, this also runs in the formatter threads */
   if (sp) {
-    pp = getpwuid(sp->st_uid);
-    gp = getgrgid(sp->st_gid);
+    un = ids_uid_to_name(sp->st_uid);
+    gn = ids_gid_to_name(sp->st_gid);
   }
 
   if (a && a->owner[0])
     us = s_dup(a->owner);
   else {
-    if (!pp) {
+    if (!un) {
       if (sp->st_uid != -1) {
 	snprintf(ubuf, sizeof(ubuf), "%u", sp->st_uid);
 	us = s_dup(ubuf);
       }
     } else
-      us = s_dup(pp->pw_name);
+      us = s_dup(un);
   }
   
   if (a && a->group[0])
     gs = s_dup(a->group);
   else {
-    if (!gp) {
+    if (!gn) {
       if (sp->st_gid != -1) {
 	snprintf(gbuf, sizeof(gbuf), "%u", sp->st_gid);
 	gs = s_dup(gbuf);
       }
     } else
-      gs = s_dup(gp->gr_name);
+      gs = s_dup(gn);
   }
 
 #if 0
@@ -422,12 +501,12 @@ print_acl(FILE *fp,
       fprintf(fp, "# type: %s\n", mode2typestr(sp->st_mode));
     if (config.f_verbose > 1) {
       fprintf(fp, "# size: %llu\n", (long long unsigned) sp->st_size);
-      fprintf(fp, "# modified: %s", ctime(&sp->st_mtime));
-      fprintf(fp, "# changed:  %s", ctime(&sp->st_ctime));
-      fprintf(fp, "# accessed: %s", ctime(&sp->st_atime));
+      fprintf(fp, "# modified: %s", ctime_r(&sp->st_mtime, cbuf));
+      fprintf(fp, "# changed:  %s", ctime_r(&sp->st_ctime, cbuf));
+      fprintf(fp, "# accessed: %s", ctime_r(&sp->st_atime, cbuf));
 #ifdef st_birthtime
       if (sp->st_birthtime)
-	fprintf(fp, "# created:  %s", ctime(&sp->st_birthtime));
+	fprintf(fp, "# created:  %s", ctime_r(&sp->st_birthtime, cbuf));
 #endif
     }
     goto End;
@@ -465,12 +544,12 @@ print_acl(FILE *fp,
     if (config.f_verbose)
       fprintf(fp, "# type: %s\n", mode2typestr(sp->st_mode));
     if (config.f_verbose > 2) {
-      fprintf(fp, "# modified: %s", ctime(&sp->st_mtime));
-      fprintf(fp, "# changed:  %s", ctime(&sp->st_ctime));
-      fprintf(fp, "# accessed: %s", ctime(&sp->st_atime));
+      fprintf(fp, "# modified: %s", ctime_r(&sp->st_mtime, cbuf));
+      fprintf(fp, "# changed:  %s", ctime_r(&sp->st_ctime, cbuf));
+      fprintf(fp, "# accessed: %s", ctime_r(&sp->st_atime, cbuf));
 #ifdef st_birthtime
       if (sp->st_birthtime)
-	fprintf(fp, "# created:  %s", ctime(&sp->st_birthtime));
+	fprintf(fp, "# created:  %s", ctime_r(&sp->st_birthtime, cbuf));
 #endif
       fprintf(fp, "# size: %llu\n", (long long unsigned) sp->st_size);
     }
@@ -583,7 +662,7 @@ print_acl(FILE *fp,
     break;
     
   case GACL_STYLE_SOLARIS:
-    tp = localtime(&sp->st_mtime);
+    tp = localtime_r(&sp->st_mtime, &tmb);
     strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %R", tp);
 
     is_trivial = 0;
@@ -687,12 +766,12 @@ print_acl(FILE *fp,
     fprintf(fp, "REVISION:1\n");
     fprintf(fp, "CONTROL:SR|DP\n");
 
-    if (pp)
+    if (un)
       fprintf(fp, "OWNER:%s\n", us);
     else
       fprintf(fp, "OWNER:%d\n", sp->st_uid);
 
-    if (gp)
+    if (gn)
       fprintf(fp, "GROUP:%s\n", gs);
     else
       fprintf(fp, "GROUP:%d\n", sp->st_gid);
@@ -732,6 +811,287 @@ print_acl(FILE *fp,
   return 0;
 }
 
+int
+print_acl(FILE *fp,
+	  gacl_t a,
+	  const char *path,
+	  const struct stat *sp,
+	  int cnt) {
+  int rc;
+
+
+  /* Keep the output for one object together when walking in parallel */
+  flockfile(fp);
+  rc = _print_acl(fp, a, path, sp, cnt);
+  funlockfile(fp);
+
+  return rc;
+}
+
+
+#if HAVE_PTHREAD_H && HAVE_OPEN_MEMSTREAM
+/*
+ * Formatting of ACLs in helper threads (--format-threads). Objects are
+ * queued in a ring buffer and rendered into private memory buffers by
+ * the formatter threads. Whichever thread finds the oldest object done
+ * writes it (and the ones after it that are done) to the output, so the
+ * output comes out in exactly the order the objects were queued in.
+ * When the ring is full the queueing thread waits.
+ */
+#define PQ_AHEAD 64		/* Objects queued per formatter thread */
+
+#define PQ_QUEUED 0
+#define PQ_BUSY   1
+#define PQ_DONE   2
+
+typedef struct pqent {
+  int state;
+  int cnt;
+  gacl_t acl;
+  char *path;
+  struct stat sb;
+  int f_stat;
+  char *buf;
+  size_t len;
+} PQENT;
+
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;
+  pthread_cond_t space;
+  FILE *fp;
+  PQENT *v;
+  size_t size;
+  size_t head;		/* Oldest object not yet written */
+  size_t next;		/* Next object for a formatter */
+  size_t tail;		/* Next free slot */
+  int f_writing;
+  int f_stop;
+  unsigned int nt;
+  pthread_t *tv;
+} pq;
+
+
+/* Write the finished objects at the head of the queue. Called locked. */
+static void
+_pq_drain(void) {
+  PQENT *ep;
+  char *buf;
+  size_t len;
+
+
+  if (pq.f_writing)
+    return;
+
+  pq.f_writing = 1;
+  while (pq.head < pq.tail && (ep = &pq.v[pq.head % pq.size])->state == PQ_DONE) {
+    buf = ep->buf;
+    len = ep->len;
+    ep->buf = NULL;
+    pq.head++;
+    pthread_cond_broadcast(&pq.space);
+
+    pthread_mutex_unlock(&pq.mtx);
+    if (buf) {
+      fwrite(buf, 1, len, pq.fp);
+      free(buf);
+    }
+    pthread_mutex_lock(&pq.mtx);
+  }
+  pq.f_writing = 0;
+}
+
+static void
+_pq_render(PQENT *ep) {
+  FILE *mfp;
+
+
+  ep->buf = NULL;
+  ep->len = 0;
+
+  mfp = open_memstream(&ep->buf, &ep->len);
+  if (mfp) {
+    _print_acl(mfp, ep->acl, ep->path, ep->f_stat ? &ep->sb : NULL, ep->cnt);
+    fclose(mfp);
+  } else
+    fprintf(stderr, "%s: Error: %s: Unable to display ACL: %s\n", argv0, ep->path, strerror(errno));
+
+  if (ep->acl)
+    gacl_free(ep->acl);
+  ep->acl = NULL;
+  free(ep->path);
+  ep->path = NULL;
+}
+
+static void *
+_pq_thread(void *vp) {
+  PQENT *ep;
+
+
+  pthread_mutex_lock(&pq.mtx);
+  for (;;) {
+    while (!pq.f_stop && pq.next >= pq.tail)
+      pthread_cond_wait(&pq.work, &pq.mtx);
+    if (pq.next >= pq.tail)
+      break;
+
+    ep = &pq.v[pq.next++ % pq.size];
+    ep->state = PQ_BUSY;
+    pthread_mutex_unlock(&pq.mtx);
+
+    _pq_render(ep);
+
+    pthread_mutex_lock(&pq.mtx);
+    ep->state = PQ_DONE;
+    _pq_drain();
+  }
+  pthread_mutex_unlock(&pq.mtx);
+  return NULL;
+}
+
+
+/*
+ * Start 'nt' formatter threads for print_acl_queue(). Returns the number
+ * of threads started. If none, objects are printed directly.
+ */
+int
+print_acl_start(FILE *fp,
+		unsigned int nt) {
+  if (pq.tv || nt == 0)
+    return 0;
+
+  pq.size = nt*PQ_AHEAD;
+  pq.v = calloc(pq.size, sizeof(pq.v[0]));
+  pq.tv = calloc(nt, sizeof(pq.tv[0]));
+  if (!pq.v || !pq.tv) {
+    free(pq.v);
+    free(pq.tv);
+    pq.v = NULL;
+    pq.tv = NULL;
+    return -1;
+  }
+
+  pthread_mutex_init(&pq.mtx, NULL);
+  pthread_cond_init(&pq.work, NULL);
+  pthread_cond_init(&pq.space, NULL);
+  pq.fp = fp;
+  pq.head = pq.next = pq.tail = 0;
+  pq.f_writing = pq.f_stop = 0;
+
+  for (pq.nt = 0; pq.nt < nt; pq.nt++)
+    if (pthread_create(&pq.tv[pq.nt], NULL, _pq_thread, NULL) != 0)
+      break;
+
+  if (pq.nt == 0) {
+    print_acl_end();
+    return 0;
+  }
+
+  return pq.nt;
+}
+
+
+/* Wait for all queued objects to be written and stop the threads */
+void
+print_acl_end(void) {
+  unsigned int i;
+
+
+  if (!pq.tv)
+    return;
+
+  pthread_mutex_lock(&pq.mtx);
+  pq.f_stop = 1;
+  pthread_cond_broadcast(&pq.work);
+  pthread_mutex_unlock(&pq.mtx);
+
+  for (i = 0; i < pq.nt; i++)
+    pthread_join(pq.tv[i], NULL);
+
+  pthread_mutex_lock(&pq.mtx);
+  _pq_drain();
+  pthread_mutex_unlock(&pq.mtx);
+  fflush(pq.fp);
+
+  pthread_mutex_destroy(&pq.mtx);
+  pthread_cond_destroy(&pq.work);
+  pthread_cond_destroy(&pq.space);
+  free(pq.v);
+  free(pq.tv);
+  pq.v = NULL;
+  pq.tv = NULL;
+  pq.nt = 0;
+}
+
+#else
+
+int
+print_acl_start(FILE *fp,
+		unsigned int nt) {
+  return 0;
+}
+
+void
+print_acl_end(void) {
+}
+
+#endif
+
+
+/*
+ * Print the ACL of an object, or queue it for the formatter threads if
+ * they are running. Takes over 'a'. The object counter *np is increased
+ * in output order.
+ */
+int
+print_acl_queue(FILE *fp,
+		gacl_t a,
+		const char *path,
+		const struct stat *sp,
+		int *np) {
+  int rc;
+#if HAVE_PTHREAD_H && HAVE_OPEN_MEMSTREAM
+  PQENT *ep;
+  char *pp;
+
+
+  if (pq.tv && fp == pq.fp) {
+    pp = strdup(path);
+    if (!pp) {
+      if (a)
+	gacl_free(a);
+      return -1;
+    }
+
+    pthread_mutex_lock(&pq.mtx);
+    while (pq.tail - pq.head >= pq.size)
+      pthread_cond_wait(&pq.space, &pq.mtx);
+
+    ep = &pq.v[pq.tail % pq.size];
+    ep->state = PQ_QUEUED;
+    ep->acl = a;
+    ep->path = pp;
+    ep->f_stat = (sp != NULL);
+    if (sp)
+      ep->sb = *sp;
+    ep->cnt = ++*np;
+    pq.tail++;
+    pthread_cond_signal(&pq.work);
+    pthread_mutex_unlock(&pq.mtx);
+    return 0;
+  }
+#endif
+
+  flockfile(fp);
+  ++*np;
+  rc = print_acl(fp, a, path, sp, *np);
+  funlockfile(fp);
+
+  if (a)
+    gacl_free(a);
+  return rc;
+}
+
 
 int
 str2style(const char *str,
@@ -817,7 +1177,7 @@ mode2typestr(mode_t m) {
 
 char *
 mode2str(mode_t m) {
-  static char buf[11];
+  static __thread char buf[11];
 
   switch (m & S_IFMT) {
   case S_IFIFO:
@@ -866,6 +1226,181 @@ mode2str(mode_t m) {
   return buf;
 }
 
+/*
+ * Read the next path from a list of newline or NUL separated paths into
+ * *bufp. The separator is decided by whichever one is seen first.
+ * Returns 1 if a path was read, 0 at the end of the list and -1 on errors.
+ */
+static int
+_read_path(FILE *fp,
+	   char **bufp,
+	   size_t *sizep,
+	   int *sepp) {
+  size_t len = 0;
+  int c;
+
+
+  while ((c = getc(fp)) != EOF) {
+    if (*sepp < 0 && (c == '\n' || c == '\0'))
+      *sepp = c;
+    if (c == *sepp) {
+      if (len == 0)
+	continue;
+      break;
+    }
+    if (len+1 >= *sizep) {
+      size_t ns = *sizep ? *sizep*2 : 1024;
+      char *nb = realloc(*bufp, ns);
+
+      if (!nb)
+	return -1;
+      *bufp = nb;
+      *sizep = ns;
+    }
+    (*bufp)[len++] = c;
+  }
+  if (ferror(fp))
+    return -1;
+  if (len == 0)
+    return 0;
+
+  (*bufp)[len] = '\0';
+  return 1;
+}
+
+/*
+ * Get the time for --changed-since. Either a timestamp (seconds since
+ * the epoch or "YYYY-MM-DD[ HH:MM[:SS]]" in local time) or the name of
+ * a state file holding the start time of the last successful run (a
+ * missing state file means everything is processed).
+ */
+static int
+_changed_since(const char *s,
+	       time_t *tp,
+	       int *f_statefile) {
+  struct tm tm;
+  const char *cp;
+  char *ep;
+  long v;
+  int pos, mday;
+  FILE *fp;
+
+
+  *f_statefile = 0;
+  
+  v = strtol(s, &ep, 10);
+  if (ep != s && !*ep) {
+    *tp = v;
+    return 0;
+  }
+
+  memset(&tm, 0, sizeof(tm));
+  pos = -1;
+  if (sscanf(s, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &pos) == 3) {
+    /* Looks like a date, so a typo must not turn it into a state file */
+    cp = s+pos;
+    if (*cp == ' ' || *cp == 'T') {
+      pos = -1;
+      if (sscanf(cp+1, "%d:%d%n", &tm.tm_hour, &tm.tm_min, &pos) == 2) {
+	cp += pos+1;
+	pos = -1;
+	if (*cp == ':' && sscanf(cp+1, "%d%n", &tm.tm_sec, &pos) == 1)
+	  cp += pos+1;
+      }
+    }
+    if (*cp ||
+	tm.tm_year < 1970 || tm.tm_mon < 1 || tm.tm_mon > 12 ||
+	tm.tm_mday < 1 || tm.tm_mday > 31 ||
+	tm.tm_hour < 0 || tm.tm_hour > 23 ||
+	tm.tm_min < 0 || tm.tm_min > 59 ||
+	tm.tm_sec < 0 || tm.tm_sec > 60) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    mday = tm.tm_mday;
+    *tp = mktime(&tm);
+    if (*tp == (time_t) -1)
+      return -1;
+
+    /* mktime() moves days past the end of the month into the next one */
+    if (tm.tm_mday != mday) {
+      errno = EINVAL;
+      return -1;
+    }
+    return 0;
+  }
+
+  *f_statefile = 1;
+  fp = fopen(s, "r");
+  if (!fp) {
+    if (errno != ENOENT)
+      return -1;
+    *tp = 0;
+    return 0;
+  }
+  if (fscanf(fp, "%ld", &v) != 1) {
+    fclose(fp);
+    errno = EINVAL;
+    return -1;
+  }
+  fclose(fp);
+  *tp = v;
+  return 0;
+}
+
+static int
+_changed_since_save(const char *file,
+		    time_t t) {
+  char *tmp;
+  FILE *fp;
+  int rc;
+
+
+  tmp = s_dupcat(file, ".tmp", NULL);
+  if (!tmp)
+    return -1;
+  
+  fp = fopen(tmp, "w");
+  if (!fp) {
+    free(tmp);
+    return -1;
+  }
+  fprintf(fp, "%ld\n", (long) t);
+  rc = (fclose(fp) == 0 ? rename(tmp, file) : -1);
+  free(tmp);
+  return rc;
+}
+
+static int
+_aclcmd_path(int i,
+	     const char *path,
+	     int (*handler)(const char *path,
+			    const struct stat *sp,
+			    size_t base,
+			    size_t level,
+			    void *vp),
+	     void *vp,
+	     size_t maxlevel) {
+  int rc;
+
+
+  if (ft_checkpoint_arg(i))
+    return 0;
+
+  rc = ft_foreach(path, handler, vp, maxlevel, config.f_filetype);
+  if (rc < 0) {
+    fprintf(stderr, "%s: Error: %s: Accessing object: %s\n", 
+	    argv0, path, strerror(errno));
+    rc = 1;
+  }
+
+  return rc;
+}
+
 int
 aclcmd_foreach(int argc,
 	       char **argv,
@@ -875,25 +1410,83 @@ aclcmd_foreach(int argc,
 			      size_t level,
 			      void *vp),
 	       void *vp) {
-  int i, rc = 0;
+  int i, rc = 0, f_statefile = 0;
+  time_t since = 0, start;
   
 
-  for (i = 0; rc == 0 && i < argc; i++) {
-    rc = ft_foreach(argv[i], handler, vp,
-		    config.f_recurse ? -1 : config.max_depth, config.f_filetype);
-    if (rc) {
-#if 0
-      error(1, errno, "%s: Accessing", argv[i]);
-#else
-      if (rc < 0) {
-	fprintf(stderr, "%s: Error: %s: Accessing object: %s\n", 
-		argv0, argv[i], strerror(errno));
+  time(&start);
+  if (config.changed_since &&
+      _changed_since(config.changed_since, &since, &f_statefile) < 0) {
+    fprintf(stderr, "%s: Error: %s: Changed since: %s\n",
+	    argv0, config.changed_since, strerror(errno));
+    return 1;
+  }
+  ft_changed_since(since);
+  vfs_rate_limit(config.max_ops, config.max_writes);
+  ft_sample_set(config.sample, config.sample_per_dir, config.sample_seed);
+
+  if ((config.checkpoint || config.resume) &&
+      ft_checkpoint_init(config.checkpoint, config.resume) < 0) {
+    fprintf(stderr, "%s: Error: %s: Checkpoint: %s\n",
+	    argv0, config.resume ? config.resume : config.checkpoint, strerror(errno));
+    ft_reset();
+    return 1;
+  }
+
+  for (i = 0; rc == 0 && i < argc; i++)
+    rc = _aclcmd_path(i, argv[i], handler, vp,
+		      config.f_recurse ? -1 : config.max_depth);
+
+  if (rc == 0 && config.from) {
+    /* Paths read from a list are only handled themselves, no recursion */
+    FILE *fp = (strcmp(config.from, "-") == 0 ? stdin : fopen(config.from, "r"));
+    char *buf = NULL;
+    size_t size = 0;
+    int n, sep = -1;
+
+    if (!fp) {
+      fprintf(stderr, "%s: Error: %s: Opening: %s\n", argv0, config.from, strerror(errno));
+      rc = 1;
+    } else {
+      while (rc == 0 && (n = _read_path(fp, &buf, &size, &sep)) > 0)
+	rc = _aclcmd_path(i++, buf, handler, vp, 0);
+      if (rc == 0 && n < 0) {
+	fprintf(stderr, "%s: Error: %s: Reading: %s\n", argv0, config.from, strerror(errno));
 	rc = 1;
       }
-      break;
-#endif
+      if (fp != stdin)
+	fclose(fp);
+      else
+	clearerr(fp);
+      free(buf);
     }
   }
 
+  ft_checkpoint_done(rc);
+  ft_changed_since(0);
+  vfs_rate_limit(0, 0);
+  ft_sample_set(0, 0, 0);
+
+  if (rc == 0 && f_statefile &&
+      _changed_since_save(config.changed_since, start) < 0) {
+    fprintf(stderr, "%s: Error: %s: Saving state: %s\n",
+	    argv0, config.changed_since, strerror(errno));
+    rc = 1;
+  }
+
+  if (config.f_dedup) {
+    size_t n = ft_links_done();
+
+    if (config.f_verbose && n > 0)
+      printf("%lu hard link%s skipped\n", (unsigned long) n, n == 1 ? "" : "s");
+  }
+
+  if (config.f_debug) {
+    unsigned long hits, misses;
+
+    ids_stats(&hits, &misses);
+    fprintf(stderr, "*** aclcmd_foreach: ID cache: %lu hits, %lu misses\n",
+	    hits, misses);
+  }
   return rc;
 }
@@ -64,6 +64,17 @@ set_acl(const char *path,
 	gacl_t ap,
 	gacl_t oap);
 
+extern gacl_t
+prepare_acl(const char *name,
+	    gacl_t ap,
+	    mode_t mode);
+
+extern int
+set_prepared_acl(const char *path,
+		 const struct stat *sp,
+		 gacl_t ap,
+		 gacl_t oap);
+
 extern int
 str2filetype(const char *str,
 	     mode_t *f_filetype);
@@ -76,6 +87,20 @@ print_acl(FILE *fp,
 	  const struct stat *sp,
 	  int cnt);
 
+extern int
+print_acl_start(FILE *fp,
+		unsigned int nt);
+
+extern int
+print_acl_queue(FILE *fp,
+		gacl_t a,
+		const char *path,
+		const struct stat *sp,
+		int *np);
+
+extern void
+print_acl_end(void);
+
 
 extern int
 str2style(const char *str,
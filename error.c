@@ -43,7 +43,7 @@
 
 char *error_argv0 = NULL;
 
-jmp_buf error_env;
+__thread jmp_buf error_env;
 
 
 int
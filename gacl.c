@@ -36,17 +36,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <limits.h>
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #include "gacl.h"
 #include "gacl_impl.h"
 
 #include "vfs.h"
 #include "strings.h"
+#include "ids.h"
 
 
 static struct gace_perm2c {
@@ -139,6 +143,8 @@ gacl_free(void *op) {
 
   switch (*mp) {
   case GACL_MAGIC_ACL:
+    free(((GACL *) op)->native);
+    /* Fall through */
   case GACL_MAGIC_TEXT:
   case GACL_MAGIC_QUALIFIER:
     *mp = GACL_MAGIC_FREED;
@@ -315,8 +321,10 @@ gacl_init(int count) {
 #endif
 
 
-  if (count < GACL_MIN_ENTRIES)
+  if (count <= 0)
     count = GACL_DEFAULT_ENTRIES;
+  else if (count < GACL_MIN_ENTRIES)
+    count = GACL_MIN_ENTRIES;
 
 #if 1
   ap = _gacl_alloc(GACL_MAGIC_ACL, count*sizeof(ap->av[0]));
@@ -406,8 +414,10 @@ gacl_get_entry(GACL *ap,
   return 1;
 }
 
-/* If index < 0 or index > last -> append */
-/* TODO: Realloc() GACL if need to extent to make room for more GACL_ENTRYs */
+/*
+ * If index < 0 or index > last -> append.
+ * The ACL is grown if needed, so *app may change.
+ */
 int
 gacl_create_entry_np(GACL **app,
 		     GACL_ENTRY **epp,
@@ -423,8 +433,17 @@ gacl_create_entry_np(GACL **app,
 
   ap = *app;
   if (ap->ac >= ap->as) {
-    errno = ENOMEM;
-    return -1;
+    /* Double the capacity, so building an ACL of n entries is O(n) */
+    GACL_MAGIC *mp = ((GACL_MAGIC *) ap)-1;
+    int ns = ap->as*2;
+
+    mp = realloc(mp, sizeof(*mp) + sizeof(*ap) + ns*sizeof(ap->av[0]));
+    if (!mp)
+      return -1;
+
+    ap = (GACL *) (mp+1);
+    ap->as = ns;
+    *app = ap;
   }
 
   if (index < 0 || index > ap->ac)
@@ -453,12 +472,14 @@ int
 gacl_add_entry_np(GACL **app,
 		  GACL_ENTRY *ep,
 		  int index) {
-  GACL_ENTRY *nep;
+  GACL_ENTRY *nep, e;
 
+  /* The ACL may move when it grows, and ep might point into it */
+  e = *ep;
   if (gacl_create_entry_np(app, &nep, index) < 0)
     return -1;
 
-  if (gacl_copy_entry(nep, ep) < 0)
+  if (gacl_copy_entry(nep, &e) < 0)
     return -1;
 
   return 0;
@@ -532,7 +553,7 @@ gacl_dup(GACL *ap) {
   int i;
 
 
-  nap = gacl_init(ap->as);
+  nap = gacl_init(ap->ac);
   if (!nap)
     return NULL;
 
@@ -807,7 +828,7 @@ gacl_strip_np(GACL *ap,
   int i, rc;
 
 
-  nap = gacl_init(ap->as);
+  nap = gacl_init(ap->ac);
   if (!nap)
     return NULL;
 
@@ -957,11 +978,14 @@ gacl_entry_match(GACL_ENTRY *aep,
 }
 
 
+/*
+ * Does not use the entry iterators so it can be used on ACLs that are
+ * shared between threads.
+ */
 int
 gacl_match(GACL *ap,
 	   GACL *mp) {
-  GACL_ENTRY *aep, *mep;
-  int p, arc, mrc;
+  int i, rc;
 
 
   if (ap->ac != mp->ac)
@@ -970,13 +994,8 @@ gacl_match(GACL *ap,
   if (ap->type != mp->type)
     return 0;
 
-  p = GACL_FIRST_ENTRY;
-  while ((arc = gacl_get_entry(ap, p, &aep)) == 1 && (mrc = gacl_get_entry(mp, p, &mep)) == 1) {
-    int rc;
-
-    p = GACL_NEXT_ENTRY;
-
-    rc = gacl_entry_match(aep, mep);
+  for (i = 0; i < ap->ac; i++) {
+    rc = gacl_entry_match(&ap->av[i], &mp->av[i]);
     if (rc != 1)
       return rc;
   }
@@ -987,6 +1006,44 @@ gacl_match(GACL *ap,
 
 
 
+/*
+ * Build a path that resolves relative to a directory fd without
+ * looking up the directory's own path again. Only Linux can do this
+ * (via /proc) since there are no *at() versions of the ACL calls.
+ */
+static const char *
+_gacl_at_path(int fd,
+	      const char *path,
+	      char *buf,
+	      size_t bufsize) {
+#if defined(__linux__)
+  static int have_proc = -1;
+#endif
+
+  
+  if (fd == AT_FDCWD || *path == '/')
+    return path;
+  
+#if defined(__linux__)
+  if (have_proc < 0)
+    have_proc = (access("/proc/self/fd", X_OK) == 0);
+  
+  if (have_proc) {
+    int rc = snprintf(buf, bufsize, "/proc/self/fd/%d/%s", fd, path);
+    
+    if (rc < 0 || (size_t) rc >= bufsize) {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+    return buf;
+  }
+#endif
+
+  errno = ENOSYS;
+  return NULL;
+}
+
+
 GACL *
 gacl_get_file(const char *path,
 	      GACL_TYPE type) {
@@ -1012,6 +1069,22 @@ gacl_get_fd(int fd) {
   return gacl_get_fd_np(fd, GACL_TYPE_ACCESS);
 }
 
+GACL *
+gacl_get_fileat_np(int fd,
+		   const char *path,
+		   GACL_TYPE type,
+		   int flags) {
+  char buf[PATH_MAX];
+
+  
+  path = _gacl_at_path(fd, path, buf, sizeof(buf));
+  if (!path)
+    return NULL;
+  
+  return _gacl_get_fd_file(-1, path, type,
+			   (flags & AT_SYMLINK_NOFOLLOW) ? GACL_F_SYMLINK_NOFOLLOW : 0);
+}
+
 
 int
 gacl_set_file(const char *path,
@@ -1042,6 +1115,40 @@ gacl_set_fd(int fd,
   return gacl_set_fd_np(fd, ap, GACL_TYPE_ACCESS);
 }
 
+int
+gacl_set_fileat_np(int fd,
+		   const char *path,
+		   GACL_TYPE type,
+		   GACL *ap,
+		   int flags) {
+  char buf[PATH_MAX];
+
+  
+  path = _gacl_at_path(fd, path, buf, sizeof(buf));
+  if (!path)
+    return -1;
+  
+  return _gacl_set_fd_file(-1, path, type, ap,
+			   (flags & AT_SYMLINK_NOFOLLOW) ? GACL_F_SYMLINK_NOFOLLOW : 0);
+}
+
+int
+gacl_match_fileat_np(int fd,
+		     const char *path,
+		     GACL_TYPE type,
+		     GACL *ap,
+		     int flags) {
+  char buf[PATH_MAX];
+
+  
+  path = _gacl_at_path(fd, path, buf, sizeof(buf));
+  if (!path)
+    return -1;
+  
+  return _gacl_match_fd_file(-1, path, type, ap,
+			     (flags & AT_SYMLINK_NOFOLLOW) ? GACL_F_SYMLINK_NOFOLLOW : 0);
+}
+
 
 int
 _gacl_get_tag(GACL_ENTRY *ep,
@@ -1066,6 +1173,7 @@ _gacl_set_tag(GACL_ENTRY *ep,
 
   ep->tag.type = etp->type;
   ep->tag.ugid = etp->ugid;
+  ep->tag.f_unresolved = etp->f_unresolved;
 
   if (s_cpy(ep->tag.name, sizeof(ep->tag.name), etp->name) < 0)
     return -1;
@@ -1084,7 +1192,7 @@ _gacl_tag_compare(GACL_TAG *a,
   if (d)
     return d;
 
-  d = a->ugid - b->ugid;
+  d = GACL_TAG_UGID(a) - GACL_TAG_UGID(b);
   if (d)
     return d;
 
@@ -1110,12 +1218,15 @@ int
 _gacl_tag_from_text(GACL_TAG *etp,
 		    char **bufp,
 		    int flags) {
-  struct passwd *pp;
-  struct group *gp;
+  const char *name;
   char *np, *cp = *bufp;
   size_t len;
+  uid_t uid = -1;
+  gid_t gid = -1;
+  int f_user, f_group;
 
 
+  etp->f_unresolved = 0;
   if (strncmp(cp, "user:", 5) == 0 || strncmp(cp, "u:", 2) == 0) {
     etp->type = GACL_TAG_TYPE_USER;
 
@@ -1127,9 +1238,9 @@ _gacl_tag_from_text(GACL_TAG *etp,
       ++np;
 
     if (sscanf(cp, "%d", &etp->ugid) == 1) {
-      pp = getpwuid(etp->ugid);
-      if (pp) {
-	if (s_cpy(etp->name, sizeof(etp->name), pp->pw_name) < 0)
+      name = ids_uid_to_name(etp->ugid);
+      if (name) {
+	if (s_cpy(etp->name, sizeof(etp->name), name) < 0)
 	  return -1;
       } else {
 	if (flags & GACL_TEXT_RELAXED) {
@@ -1153,8 +1264,8 @@ _gacl_tag_from_text(GACL_TAG *etp,
       if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
 	return -1;
 
-      if ((pp = getpwnam(etp->name)) != NULL)
-	etp->ugid = pp->pw_uid;
+      if (ids_name_to_uid(etp->name, &uid))
+	etp->ugid = uid;
       else {
 	if (flags & GACL_TEXT_RELAXED)
 	  etp->ugid = -1;
@@ -1184,9 +1295,9 @@ _gacl_tag_from_text(GACL_TAG *etp,
       ++np;
 
     if (sscanf(cp, "%d", &etp->ugid) == 1) {
-      gp = getgrgid(etp->ugid);
-      if (gp) {
-	if (s_cpy(etp->name, sizeof(etp->name), gp->gr_name) < 0)
+      name = ids_gid_to_name(etp->ugid);
+      if (name) {
+	if (s_cpy(etp->name, sizeof(etp->name), name) < 0)
 	  return -1;
       } else {
 	if (flags & GACL_TEXT_RELAXED) {
@@ -1210,8 +1321,8 @@ _gacl_tag_from_text(GACL_TAG *etp,
       if (s_ncpy(etp->name, sizeof(etp->name), cp, len) < 0)
 	return -1;
 
-      if ((gp = getgrnam(etp->name)) != NULL)
-	etp->ugid = gp->gr_gid;
+      if (ids_name_to_gid(etp->name, &gid))
+	etp->ugid = gid;
       else {
 	if (flags & GACL_TEXT_RELAXED)
 	  etp->ugid = -1;
@@ -1276,25 +1387,26 @@ _gacl_tag_from_text(GACL_TAG *etp,
    */
   etp->ugid = -1;
   if (sscanf(etp->name, "%d", &etp->ugid) == 1) {
-    pp = getpwuid(etp->ugid);
-    gp = getgrgid(etp->ugid);
+    uid = gid = etp->ugid;
+    f_user = (ids_uid_to_name(uid) != NULL);
+    f_group = (ids_gid_to_name(gid) != NULL);
   } else {
-    pp = getpwnam(etp->name);
-    gp = getgrnam(etp->name);
+    f_user = ids_name_to_uid(etp->name, &uid);
+    f_group = ids_name_to_gid(etp->name, &gid);
   }
 
   /* Non-unique name */
-  if (pp && gp) {
+  if (f_user && f_group) {
     errno = EINVAL;
     return -1;
   }
 
-  if (pp) {
+  if (f_user) {
     etp->type = GACL_TAG_TYPE_USER;
-    etp->ugid = pp->pw_uid;
-  } else if (gp) {
+    etp->ugid = uid;
+  } else if (f_group) {
     etp->type = GACL_TAG_TYPE_GROUP;
-    etp->ugid = gp->gr_gid;
+    etp->ugid = gid;
   } else {
     if (flags & GACL_TEXT_RELAXED)
       etp->type = GACL_TAG_TYPE_UNKNOWN;
@@ -1361,7 +1473,7 @@ gacl_get_qualifier(GACL_ENTRY *ep) {
     if (!idp)
       return NULL;
 
-    *idp = ep->tag.ugid;
+    *idp = GACL_TAG_UGID(&ep->tag);
     return (void *) idp;
 
   default:
@@ -1382,6 +1494,7 @@ gacl_set_qualifier(GACL_ENTRY *ep,
   case GACL_TAG_TYPE_USER:
   case GACL_TAG_TYPE_GROUP:
     ep->tag.ugid = * (uid_t *) qp;
+    ep->tag.f_unresolved = 0;
     return 0;
 
   default:
@@ -1854,11 +1967,11 @@ gacl_entry_to_text(GACL_ENTRY *ep,
     rc = 0;
     switch (et) {
     case GACL_TAG_TYPE_USER:
-      rc = snprintf(bp, bufsize, "\t# uid=%d", ep->tag.ugid);
+      rc = snprintf(bp, bufsize, "\t# uid=%d", GACL_TAG_UGID(&ep->tag));
       f_comment++;
       break;
     case GACL_TAG_TYPE_GROUP:
-      rc = snprintf(bp, bufsize, "\t# gid=%d", ep->tag.ugid);
+      rc = snprintf(bp, bufsize, "\t# gid=%d", GACL_TAG_UGID(&ep->tag));
       f_comment++;
       break;
     default:
@@ -1972,19 +2085,19 @@ char *
 gacl_to_text_np(GACL *ap,
 		ssize_t *bsp,
 		int flags) {
-  char *buf, *bp;
-  size_t bufsize = 2048;
+  char *buf;
+  size_t bufsize = 2048, used = 0;
   int i, rc;
   GACL_ENTRY *ep;
   int tagwidth = ((flags & GACL_TEXT_STANDARD) ? 18 : _gacl_max_tagwidth(ap)+8);
 
 
-  bp = buf = _gacl_alloc(GACL_MAGIC_TEXT, bufsize);
+  buf = _gacl_alloc(GACL_MAGIC_TEXT, bufsize);
   if (!buf)
     return NULL;
 
   for (i = 0;
-       bufsize > 1 && ((rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1);
+       (rc = gacl_get_entry(ap, i ? GACL_NEXT_ENTRY : GACL_FIRST_ENTRY, &ep)) == 1;
        i++) {
     char es[1024], *cp;
     ssize_t rc, len;
@@ -2008,22 +2121,39 @@ gacl_to_text_np(GACL *ap,
     } else
       len = 0;
 
+ Again:
     if (flags & GACL_TEXT_COMPACT)
-      rc = snprintf(bp, bufsize, "%s%s", (i > 0 ? "," : ""), es);
+      rc = snprintf(buf+used, bufsize-used, "%s%s", (i > 0 ? "," : ""), es);
     else
       if (tagwidth > len)
-	rc = snprintf(bp, bufsize, "%*s%s\n", (int) (tagwidth-len), "", es);
+	rc = snprintf(buf+used, bufsize-used, "%*s%s\n", (int) (tagwidth-len), "", es);
       else
-	rc = snprintf(bp, bufsize, "%s\n", es);
+	rc = snprintf(buf+used, bufsize-used, "%s\n", es);
     if (rc < 0)
       goto Fail;
 
-    bp += rc;
-    bufsize -= rc;
+    if (used+rc >= bufsize) {
+      /* Truncated - double the buffer until the entry fits and redo it */
+      GACL_MAGIC *mp = ((GACL_MAGIC *) buf)-1;
+      size_t ns = bufsize*2;
+
+      while (used+rc >= ns)
+	ns *= 2;
+
+      mp = realloc(mp, sizeof(*mp) + ns);
+      if (!mp)
+	goto Fail;
+
+      buf = (char *) (mp+1);
+      bufsize = ns;
+      goto Again;
+    }
+
+    used += rc;
   }
 
   if (bsp)
-    *bsp = (bp-buf);
+    *bsp = used;
 
   return buf;
 
@@ -86,9 +86,13 @@ typedef enum gacl_tag_type {
 typedef struct gacl_entry_tag {
   GACL_TAG_TYPE type;
   uid_t ugid;
+  int f_unresolved;	/* ugid not looked up from name yet */
   char name[256];
 } GACL_TAG;
 
+/* The uid/gid of a user or group tag, looked up on first use */
+#define GACL_TAG_UGID(tp) ((tp)->f_unresolved ? _gacl_resolve_tag(tp) : (tp)->ugid)
+
 
 typedef uint32_t GACL_PERM;
 typedef uint32_t GACL_PERMSET;
@@ -189,6 +193,8 @@ typedef struct gacl {
   int ac;
   int as;
   int ap;
+  char *native;		/* Cached native form (see gacl_encode_np) */
+  size_t nativelen;
   GACL_ENTRY av[0];
 } GACL;
 
@@ -207,8 +213,9 @@ typedef GACL_FLAGSET *gacl_flagset_t;
 typedef GACL_ENTRY_TYPE gacl_entry_type_t;
 
 
-#define GACL_MIN_ENTRIES      16
-#define GACL_DEFAULT_ENTRIES 128
+/* Initial capacity, ACLs grow as needed (see gacl_create_entry_np()) */
+#define GACL_MIN_ENTRIES       4
+#define GACL_DEFAULT_ENTRIES  16
 
 
 extern GACL *
@@ -229,6 +236,9 @@ gacl_match(GACL *ap,
 	   GACL *mp);
 
 
+extern uid_t
+_gacl_resolve_tag(GACL_TAG *tp);
+
 extern int
 _gacl_set_tag(GACL_ENTRY *ep,
 	      GACL_TAG *etp);
@@ -338,6 +348,13 @@ gacl_get_fd_np(int fd,
 extern GACL *
 gacl_get_fd(int fd);
 
+/* Relative to a directory fd (flags may include AT_SYMLINK_NOFOLLOW), fails with ENOSYS if unsupported */
+extern GACL *
+gacl_get_fileat_np(int fd,
+		   const char *path,
+		   GACL_TYPE type,
+		   int flags);
+
 extern int
 gacl_set_file(const char *path,
 	      GACL_TYPE type,
@@ -358,6 +375,28 @@ extern int
 gacl_set_fd(int fd,
 	    GACL *ap);
 
+extern int
+gacl_set_fileat_np(int fd,
+		   const char *path,
+		   GACL_TYPE type,
+		   GACL *ap,
+		   int flags);
+
+/*
+ * Encode an ACL into the native form used by the system once, for
+ * setting it on many objects. The ACL must not be modified afterwards.
+ */
+extern int
+gacl_encode_np(GACL *ap);
+
+/* Returns 1 if an object already has the ACL, 0 if not */
+extern int
+gacl_match_fileat_np(int fd,
+		     const char *path,
+		     GACL_TYPE type,
+		     GACL *ap,
+		     int flags);
+
 extern int
 gacl_set_tag_type(GACL_ENTRY *ep,
 		  GACL_TAG_TYPE et);
@@ -42,11 +42,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #include "gacl.h"
 #include "gacl_impl.h"
 
 #include "vfs.h"
 #include "strings.h"
+#include "ids.h"
 
 
 
@@ -57,8 +62,6 @@
 #include <sys/xattr.h>
 #include "nfs4.h"
 
-#define ACL_NFS4_XATTR "system.nfs4_acl"
-
 /*
  * xattr format:
  * 
@@ -77,19 +80,17 @@
  */
 
 
-static char *
-_nfs4_id_domain(void) {
-  static char *saved_domain = NULL;
+static char *saved_domain = NULL;
+
+static void
+_nfs4_id_domain_load(void) {
   FILE *fp;
   char buf[256];
 
 
-  if (saved_domain)
-    return saved_domain;
-
   fp = fopen("/etc/idmapd.conf","r");
   if (!fp)
-    return NULL;
+    return;
 
   while (fgets(buf, sizeof(buf), fp)) {
     char *bp, *t;
@@ -104,10 +105,8 @@ _nfs4_id_domain(void) {
       if (!t || strcmp(t, "=") != 0)
 	continue;
       t = strsep(&bp, " \t\n");
-      if (!t) {
-	fclose(fp);
-	return NULL;
-      }
+      if (!t)
+	break;
 	
       saved_domain = strdup(t);
       break;
@@ -115,6 +114,23 @@ _nfs4_id_domain(void) {
   }
 
   fclose(fp);
+}
+
+/* Read once, the walker threads all need it */
+static char *
+_nfs4_id_domain(void) {
+#if HAVE_PTHREAD_H
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, _nfs4_id_domain_load);
+#else
+  static int f_loaded = 0;
+
+  if (!f_loaded) {
+    _nfs4_id_domain_load();
+    f_loaded = 1;
+  }
+#endif
   return saved_domain;
 }
 
@@ -122,31 +138,25 @@ _nfs4_id_domain(void) {
 static int
 _nfs4_id_to_uid(char *buf,
 		uid_t *uidp) {
-  struct passwd *pp;
-  int i;
+  int i, rc;
   char *idd = NULL;
 
 
   /* First we try a direct lookup (user@realm) - it might work... */
-  pp = getpwnam(buf);
-  if (pp) {
-    *uidp = pp->pw_uid;
+  if (ids_name_to_uid(buf, uidp))
     return 1;
-  }
   
   idd = _nfs4_id_domain();
 
   for (i = 0; buf[i] && buf[i] != '@'; i++)
     ;
   
-  if (buf[i] && (!idd || strcmp(idd, buf+i) == 0)) {
+  if (buf[i] && (!idd || strcmp(idd, buf+i+1) == 0)) {
     buf[i] = '\0';
-    pp = getpwnam(buf);
+    rc = ids_name_to_uid(buf, uidp);
     buf[i] = '@';
-    if (pp) {
-      *uidp = pp->pw_uid;
+    if (rc)
       return 1;
-    }
   } else if (sscanf(buf, "%d", uidp) == 1)
     return 1;
   
@@ -158,31 +168,25 @@ _nfs4_id_to_uid(char *buf,
 static int
 _nfs4_id_to_gid(char *buf,
 		gid_t *gidp) {
-  struct group *gp;
-  int i;
+  int i, rc;
   char *idd = NULL;
 
 
   /* First try a direct lookup (group@realm) - might work */
-  gp = getgrnam(buf);
-  if (gp) {
-    *gidp = gp->gr_gid;
+  if (ids_name_to_gid(buf, gidp))
     return 1;
-  }
   
   idd = _nfs4_id_domain();
 
   for (i = 0; buf[i] && buf[i] != '@'; i++)
     ;
 
-  if (buf[i] && (!idd || strcmp(idd, buf+1) == 0)) {
+  if (buf[i] && (!idd || strcmp(idd, buf+i+1) == 0)) {
     buf[i] = '\0';
-    gp = getgrnam(buf);
+    rc = ids_name_to_gid(buf, gidp);
     buf[i] = '@';
-    if (gp) {
-      *gidp = gp->gr_gid;
+    if (rc)
       return 1;
-    }
   } else if (sscanf(buf, "%d", gidp) == 1)
     return 1;
   
@@ -190,6 +194,23 @@ _nfs4_id_to_gid(char *buf,
 }
 
 
+/*
+ * Named principals in decoded ACLs are only looked up when their uid/gid
+ * is needed (GACL_TAG_UGID()), since listing an ACL only uses the names.
+ */
+uid_t
+_gacl_resolve_tag(GACL_TAG *tp) {
+  tp->ugid = -1;
+  if (tp->type == GACL_TAG_TYPE_GROUP)
+    (void) _nfs4_id_to_gid(tp->name, &tp->ugid);
+  else
+    (void) _nfs4_id_to_uid(tp->name, &tp->ugid);
+  
+  tp->f_unresolved = 0;
+  return tp->ugid;
+}
+
+
 static struct flagtab {
   GACL_FLAG g;
   u_int16_t s;
@@ -235,14 +256,21 @@ GACL *
 _gacl_init_from_nfs4(const char *buf,
 		     size_t bufsize) {
   int i, j;
-  u_int32_t *vp, s_flags, s_perms, na;
+  u_int32_t *vp, *endp, s_flags, s_perms, na;
   char *cp;
   GACL *ap;
 
   
   vp = (u_int32_t *) buf;
+  endp = vp + bufsize/sizeof(u_int32_t);
+  if (vp >= endp)
+    goto Invalid;
   na = ntohl(*vp++);
 
+  /* Each ACE is at least 4 words, this also catches bogus counts */
+  if (na > (endp-vp)/4)
+    goto Invalid;
+
   ap = gacl_init(na);
   if (!ap)
     return NULL;
@@ -253,9 +281,12 @@ _gacl_init_from_nfs4(const char *buf,
     u_int32_t idlen;
     GACL_ENTRY *ep;
     
-    if (gacl_create_entry_np(&ap, &ep, i) < 0) {
-      gacl_free(ap);
-      return NULL;
+    if (gacl_create_entry_np(&ap, &ep, i) < 0)
+      goto Fail;
+
+    if (endp-vp < 4) {
+      errno = EINVAL;
+      goto Fail;
     }
 
     switch (ntohl(*vp++)) {
@@ -273,7 +304,7 @@ _gacl_init_from_nfs4(const char *buf,
       break;
     default:
       errno = EINVAL;
-      return NULL;
+      goto Fail;
     }
 
     s_flags = ntohl(*vp++);
@@ -292,12 +323,16 @@ _gacl_init_from_nfs4(const char *buf,
     
     idlen = ntohl(*vp++);
     cp = (char *) vp;
+    if (idlen > (endp-vp)*sizeof(u_int32_t)) {
+      errno = EINVAL;
+      goto Fail;
+    }
 
 
     if (s_flags & NFS4_ACE_IDENTIFIER_GROUP) {
       if (strncmp(cp, "GROUP@", idlen) == 0) {
 	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), "group@") < 0)
-	  return NULL;
+	  goto Fail;
 	
 	ep->tag.type = GACL_TAG_TYPE_GROUP_OBJ;
 	ep->tag.ugid = -1;
@@ -305,24 +340,25 @@ _gacl_init_from_nfs4(const char *buf,
 	ep->tag.ugid = -1;
 	if (idlen >= sizeof(ep->tag.name)) {
 	  errno = EINVAL;
-	  return NULL;
+	  goto Fail;
 	}
 	if (s_ncpy(ep->tag.name, sizeof(ep->tag.name), cp, idlen) < 0)
-	  return NULL;
+	  goto Fail;
 	
-	(void) _nfs4_id_to_gid(ep->tag.name, &ep->tag.ugid);
+	/* Looked up when needed, see _gacl_resolve_tag() */
+	ep->tag.f_unresolved = 1;
 	ep->tag.type = GACL_TAG_TYPE_GROUP;
       }
     } else {
       if (strncmp(cp, "OWNER@", idlen) == 0) {
 	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), "owner@") < 0)
-	  return NULL;
+	  goto Fail;
 	
 	ep->tag.type = GACL_TAG_TYPE_USER_OBJ;
 	ep->tag.ugid = -1;
       } else if (strncmp(cp, "EVERYONE@", idlen) == 0) {
 	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), "everyone@") < 0)
-	  return NULL;
+	  goto Fail;
 	
 	ep->tag.type = GACL_TAG_TYPE_EVERYONE;
 	ep->tag.ugid = -1;
@@ -330,13 +366,13 @@ _gacl_init_from_nfs4(const char *buf,
 	ep->tag.ugid = -1;
 	if (idlen >= sizeof(ep->tag.name)) {
 	  errno = EINVAL;
-	  return NULL;
+	  goto Fail;
 	}
 	if (s_ncpy(ep->tag.name, sizeof(ep->tag.name), cp, idlen) < 0)
-	  return NULL;
+	  goto Fail;
 	
 	ep->tag.type = GACL_TAG_TYPE_USER;
-	(void) _nfs4_id_to_uid(ep->tag.name, &ep->tag.ugid);
+	ep->tag.f_unresolved = 1;
       }
     }
 
@@ -346,103 +382,189 @@ _gacl_init_from_nfs4(const char *buf,
   }
 
   return ap;
+
+ Fail:
+  gacl_free(ap);
+  return NULL;
+
+ Invalid:
+  errno = EINVAL;
+  return NULL;
 }
 
 
+/*
+ * Buffer for reading NFSv4 ACLs, large enough for most ACLs so they can
+ * be read with a single getxattr() call. Larger ones are read into a
+ * temporary buffer after asking for the size.
+ */
+#define NFS4_XATTR_BUFSIZE 4096
+
+static __thread u_int32_t nfs4_xattr_buf[NFS4_XATTR_BUFSIZE/sizeof(u_int32_t)];
+
+static ssize_t
+_nfs4_getxattr(int fd,
+	       const char *path,
+	       int flags,
+	       void *buf,
+	       size_t bufsize) {
+  if (!path)
+    return fgetxattr(fd, ACL_NFS4_XATTR, buf, bufsize);
+  if (flags & GACL_F_SYMLINK_NOFOLLOW)
+    return lgetxattr(path, ACL_NFS4_XATTR, buf, bufsize);
+  return getxattr(path, ACL_NFS4_XATTR, buf, bufsize);
+}
+
 GACL *
 _gacl_get_fd_file(int fd,
 		  const char *path,
 		  GACL_TYPE type,
 		  int flags) {
-  char *buf;
+  char *buf = NULL;
   ssize_t bufsize, rc;
+  GACL *ap;
 
-  
-  if (path) {
-    if (flags & GACL_F_SYMLINK_NOFOLLOW) {
-    
-      bufsize = lgetxattr(path, ACL_NFS4_XATTR, NULL, 0);
-      if (bufsize < 0)
-	return NULL;
 
-      buf = malloc(bufsize);
-      if (!buf)
-	return NULL;
+  rc = _nfs4_getxattr(fd, path, flags, nfs4_xattr_buf, sizeof(nfs4_xattr_buf));
+  if (rc >= 0)
+    return _gacl_init_from_nfs4((char *) nfs4_xattr_buf, rc);
 
-      rc = lgetxattr(path, ACL_NFS4_XATTR, buf, bufsize);
-      if (rc < 0) {
-	free(buf);
-	return NULL;
-      }
-    } else {
-      
-      bufsize = getxattr(path, ACL_NFS4_XATTR, NULL, 0);
-      if (bufsize < 0)
-	return NULL;
-      
-      buf = malloc(bufsize);
-      if (!buf)
-	return NULL;
-      
-      rc = getxattr(path, ACL_NFS4_XATTR, buf, bufsize);
-      if (rc < 0) {
-	free(buf);
-	return NULL;
-      }
-      
-    }
-  } else {
-    
-    bufsize = fgetxattr(fd, ACL_NFS4_XATTR, NULL, 0);
+  /* Too large for the buffer, get the size (it may change under us) */
+  while (errno == ERANGE) {
+    bufsize = _nfs4_getxattr(fd, path, flags, NULL, 0);
     if (bufsize < 0)
-      return NULL;
-    
+      break;
+
+    free(buf);
     buf = malloc(bufsize);
     if (!buf)
       return NULL;
-    
-    rc = fgetxattr(fd, ACL_NFS4_XATTR, buf, bufsize);
-    if (rc < 0) {
+
+    rc = _nfs4_getxattr(fd, path, flags, buf, bufsize);
+    if (rc >= 0) {
+      ap = _gacl_init_from_nfs4(buf, rc);
       free(buf);
-      return NULL;
+      return ap;
     }
-    
   }
 
-  return _gacl_init_from_nfs4(buf, bufsize);
+  free(buf);
+  return NULL;
+}
+
+/*
+ * Compare the raw ACL of an object with the encoded form of ap (if it
+ * has been encoded with gacl_encode_np()), without decoding it.
+ */
+int
+_gacl_match_fd_file(int fd,
+		    const char *path,
+		    GACL_TYPE type,
+		    GACL *ap,
+		    int flags) {
+  GACL *oap;
+  ssize_t rc;
+
+
+  if (ap->native) {
+    rc = _nfs4_getxattr(fd, path, flags, nfs4_xattr_buf, sizeof(nfs4_xattr_buf));
+    if (rc >= 0)
+      return (rc == ap->nativelen && memcmp(nfs4_xattr_buf, ap->native, rc) == 0);
+    if (errno != ERANGE)
+      return -1;
+
+    /* Larger than the buffer */
+    if (ap->nativelen <= sizeof(nfs4_xattr_buf))
+      return 0;
+  }
+
+  oap = _gacl_get_fd_file(fd, path, type, flags);
+  if (!oap)
+    return -1;
+
+  rc = gacl_match(ap, oap);
+  gacl_free(oap);
+  return rc;
 }
 
 
 
-static ssize_t 
-_gacl_to_nfs4(GACL *ap, 
-	      char *buf, 
-	      size_t bufsize) {
-  u_int32_t *vp, *endp, s_flags, s_perms;
-  size_t buflen, vlen;
-  int i, j, rc;
+/*
+ * The identifier ("who") of an encoded ACE is a special name, or a
+ * user/group name and the NFSv4 domain, or a numeric id.
+ */
+typedef struct nfs4_who {
+  const char *name;	/* NULL for numeric ids */
+  const char *domain;	/* Only for user/group names */
+  u_int32_t len;
+} NFS4_WHO;
+
+static int
+_nfs4_who(GACL_ENTRY *ep,
+	  NFS4_WHO *wp) {
+  char tbuf[16];
+  uid_t ugid;
+
+
+  wp->name = wp->domain = NULL;
+  switch (ep->tag.type) {
+  case GACL_TAG_TYPE_USER_OBJ:
+    wp->name = "OWNER@";
+    break;
+  case GACL_TAG_TYPE_GROUP_OBJ:
+    wp->name = "GROUP@";
+    break;
+  case GACL_TAG_TYPE_EVERYONE:
+    wp->name = "EVERYONE@";
+    break;
+  case GACL_TAG_TYPE_USER:
+  case GACL_TAG_TYPE_GROUP:
+    /* Names from the id cache stay valid, so they need not be copied */
+    ugid = GACL_TAG_UGID(&ep->tag);
+    wp->name = (ep->tag.type == GACL_TAG_TYPE_USER ?
+		ids_uid_to_name(ugid) : ids_gid_to_name(ugid));
+    if (!wp->name) {
+      /* Only unknown ids may be stored as numbers */
+      if (errno)
+	return -1;
+      wp->len = snprintf(tbuf, sizeof(tbuf), "%u", ugid);
+      return 0;
+    }
+    wp->domain = _nfs4_id_domain();
+    if (!wp->domain)
+      wp->domain = "";
+    wp->len = strlen(wp->name)+1+strlen(wp->domain);
+    return 0;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+
+  wp->len = strlen(wp->name);
+  return 0;
+}
+
+/* Type, flags, permissions and identifier length, then the padded identifier */
+#define NFS4_ACE_SIZE(len) (4*sizeof(u_int32_t) + (((len)+3) & ~3))
+
+static void
+_gacl_to_nfs4(GACL *ap,
+	      NFS4_WHO *wv,
+	      char *buf) {
+  u_int32_t *vp, s_flags, s_perms;
+  size_t vlen;
+  int i, j;
 
 
   vp = (u_int32_t *) buf;
-  buflen = bufsize/sizeof(u_int32_t);
-  endp = vp+buflen;
 
   /* Number of ACEs */
   *vp++ = htonl(ap->ac);
 
   for (i = 0; i < ap->ac; i++) {
-    char *idname;
-    u_int32_t idlen;
-    struct passwd *pp;
-    struct group *gp;
-    char *idd;
-    char tbuf[256];
     GACL_ENTRY *ep = &ap->av[i];
-
-    if (vp >= endp) {
-      errno = ENOMEM;
-      return -1;
-    }
+    NFS4_WHO *wp = &wv[i];
+    char *cp;
 
     switch (ep->type) {
     case GACL_ENTRY_TYPE_ALLOW:
@@ -454,17 +576,10 @@ _gacl_to_nfs4(GACL *ap,
     case GACL_ENTRY_TYPE_AUDIT:
       *vp++ = htonl(NFS4_ACE_SYSTEM_AUDIT_ACE_TYPE);
       break;
-    case GACL_ENTRY_TYPE_ALARM:
+    default:
+      /* Checked by _gacl_encode_nfs4() */
       *vp++ = htonl(NFS4_ACE_SYSTEM_ALARM_ACE_TYPE);
       break;
-    default:
-      errno = EINVAL;
-      return -1;
-    }
-    
-    if (vp >= endp) {
-      errno = ENOMEM;
-      return -1;
     }
 
     s_flags = 0;
@@ -473,80 +588,88 @@ _gacl_to_nfs4(GACL *ap,
 	s_flags |= flagtab[j].s;
 
     s_flags |= (ep->tag.type == GACL_TAG_TYPE_GROUP ||
-		ep->tag.type == GACL_TAG_TYPE_GROUP_OBJ ? 
+		ep->tag.type == GACL_TAG_TYPE_GROUP_OBJ ?
 		NFS4_ACE_IDENTIFIER_GROUP : 0);
 
-    *vp++ = htonl(s_flags); 
-    
-    if (vp >= endp) {
-      errno = ENOMEM;
-      return -1;
-    }
+    *vp++ = htonl(s_flags);
 
     s_perms = 0;
     for (j = 0; j < sizeof(permtab)/sizeof(permtab[0]); j++)
       if (ep->perms & permtab[j].g)
 	s_perms |= permtab[j].s;
-    
+
     *vp++ = htonl(s_perms);
 
-    
-    switch (ep->tag.type) {
-    case GACL_TAG_TYPE_USER_OBJ:
-      idname = "OWNER@";
-      break;
-    case GACL_TAG_TYPE_GROUP_OBJ:
-      idname = "GROUP@";
-      break;
-    case GACL_TAG_TYPE_EVERYONE:
-      idname = "EVERYONE@";
-      break;
-    case GACL_TAG_TYPE_USER:
-      pp = getpwuid(ep->tag.ugid);
-      if (pp) {
-	idd = _nfs4_id_domain();
-	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", pp->pw_name, idd ? idd : "");
-      } else
-	rc = snprintf(tbuf, sizeof(tbuf), "%u", ep->tag.ugid);
-      if (rc < 0) {
-	errno = EINVAL;
-	return -1;
-      }
-      idname = tbuf;
-      break;
-    case GACL_TAG_TYPE_GROUP:
-      gp = getgrgid(ep->tag.ugid);
-      if (gp) {
-	idd = _nfs4_id_domain();
-	rc = snprintf(tbuf, sizeof(tbuf), "%s@%s", gp->gr_name, idd ? idd : "");
-      } else
-	rc = snprintf(tbuf, sizeof(tbuf), "%u", ep->tag.ugid);
-      if (rc < 0) {
-	errno = EINVAL;
-	return -1;
-      }
-      idname = tbuf;
+    *vp++ = htonl(wp->len);
+    vlen = (wp->len+3) / sizeof(u_int32_t);
+    if (vlen)
+      vp[vlen-1] = 0;
+
+    cp = (char *) vp;
+    if (!wp->name) {
+      char tbuf[16];
+
+      snprintf(tbuf, sizeof(tbuf), "%u", ep->tag.ugid);
+      memcpy(cp, tbuf, wp->len);
+    } else if (wp->domain) {
+      size_t nlen = strlen(wp->name);
+
+      memcpy(cp, wp->name, nlen);
+      cp[nlen] = '@';
+      memcpy(cp+nlen+1, wp->domain, wp->len-nlen-1);
+    } else
+      memcpy(cp, wp->name, wp->len);
+    vp += vlen;
+  }
+}
+
+/*
+ * Encode an ACL into a malloc()ed buffer of the exact size, found by
+ * looking up the identifiers of all ACEs first.
+ */
+static char *
+_gacl_encode_nfs4(GACL *ap,
+		  size_t *lenp) {
+  NFS4_WHO wbuf[64], *wv = wbuf;
+  char *buf = NULL;
+  size_t size;
+  int i;
+
+
+  if (ap->ac > sizeof(wbuf)/sizeof(wbuf[0])) {
+    wv = malloc(ap->ac*sizeof(wv[0]));
+    if (!wv)
+      return NULL;
+  }
+
+  size = sizeof(u_int32_t);
+  for (i = 0; i < ap->ac; i++) {
+    switch (ap->av[i].type) {
+    case GACL_ENTRY_TYPE_ALLOW:
+    case GACL_ENTRY_TYPE_DENY:
+    case GACL_ENTRY_TYPE_AUDIT:
+    case GACL_ENTRY_TYPE_ALARM:
       break;
     default:
       errno = EINVAL;
-      return -1;
+      goto End;
     }
 
-    idlen = strlen(idname);
-    vlen = idlen / sizeof(u_int32_t);
-    if (idlen % sizeof(u_int32_t))
-      ++vlen;
+    if (_nfs4_who(&ap->av[i], &wv[i]) < 0)
+      goto End;
+    size += NFS4_ACE_SIZE(wv[i].len);
+  }
 
-    if (vp+vlen >= endp) {
-      errno = ENOMEM;
-      return -1;
-    }
-    *vp++ = htonl(idlen);
-    memcpy(vp, idname, idlen);
-    vp += vlen;
+  buf = malloc(size);
+  if (buf) {
+    _gacl_to_nfs4(ap, wv, buf);
+    *lenp = size;
   }
 
-  return ((char *) vp) - buf;
+ End:
+  if (wv != wbuf)
+    free(wv);
+  return buf;
 }
 
 
@@ -556,38 +679,50 @@ _gacl_set_fd_file(int fd,
 		  GACL_TYPE type,
 		  GACL *ap,
 		  int flags) {
-  char buf[8192];
-  ssize_t bufsize, rc;
+  char *buf = ap->native;
+  size_t bufsize = ap->nativelen;
+  int rc;
 
 
-  bufsize = _gacl_to_nfs4(ap, buf, sizeof(buf));
-  if (bufsize < 0)
-    return -1;
+  if (!buf) {
+    buf = _gacl_encode_nfs4(ap, &bufsize);
+    if (!buf)
+      return -1;
+  }
 
   if (path) {
     if (flags & GACL_F_SYMLINK_NOFOLLOW) {
     
       rc = lsetxattr(path, ACL_NFS4_XATTR, buf, bufsize, 0);
-      if (rc < 0)
-	return -1;
 
     } else {
       
       rc = setxattr(path, ACL_NFS4_XATTR, buf, bufsize, 0);
-      if (rc < 0)
-	return -1;
       
     }
   } else {
     
     rc = fsetxattr(fd, ACL_NFS4_XATTR, buf, bufsize, 0);
-    if (rc < 0)
-      return -1;
     
   }
 
+  if (buf != ap->native) {
+    int ec = errno;
+
+    free(buf);
+    errno = ec;
+  }
   return rc;
 }
+
+int
+gacl_encode_np(GACL *ap) {
+  if (ap->native)
+    return 0;
+
+  ap->native = _gacl_encode_nfs4(ap, &ap->nativelen);
+  return ap->native ? 0 : -1;
+}
 #endif
 
 
@@ -621,8 +756,7 @@ _gacl_set_fd_file(int fd,
 static int
 _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
 			   freebsd_acl_entry_t oep) {
-  struct passwd *pp;
-  struct group *gp;
+  const char *name;
 
 
   /* XXX TODO: Translate ae_tag - tag.type*/
@@ -650,9 +784,9 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     break;
     
   case GACL_TAG_TYPE_USER:
-    pp = getpwuid(nep->tag.ugid);
-    if (pp) {
-      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), pp->pw_name) < 0)
+    name = ids_uid_to_name(nep->tag.ugid);
+    if (name) {
+      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), name) < 0)
 	return -1;
     } else {
       int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
@@ -667,9 +801,9 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     break;
     
   case GACL_TAG_TYPE_GROUP:
-    gp = getgrgid(nep->tag.ugid);
-    if (gp) {
-      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), gp->gr_name) < 0)
+    name = ids_gid_to_name(nep->tag.ugid);
+    if (name) {
+      if (s_cpy(nep->tag.name, sizeof(nep->tag.name), name) < 0)
 	return -1;
     } else {
       int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
@@ -981,8 +1115,7 @@ _gacl_entry_to_ace(GACL_ENTRY *ep,
 static int
 _gacl_entry_from_ace(GACL_ENTRY *ep,
 		     ace_t *ap) {
-  struct passwd *pp;
-  struct group *gp;
+  const char *name;
   int i;
   
   
@@ -1017,9 +1150,9 @@ _gacl_entry_from_ace(GACL_ENTRY *ep,
     if (ap->a_flags & ACE_IDENTIFIER_GROUP) {
       ep->tag.type = GACL_TAG_TYPE_GROUP;
       ep->tag.ugid = ap->a_who;
-      gp = getgrgid(ap->a_who);
-      if (gp) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), gp->gr_name) < 0)
+      name = ids_gid_to_name(ap->a_who);
+      if (name) {
+	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), name) < 0)
 	  return -1;
       } else {
 	int rc = snprintf(ep->tag.name, sizeof(ep->tag.name), "%d", ap->a_who);
@@ -1034,9 +1167,9 @@ _gacl_entry_from_ace(GACL_ENTRY *ep,
     } else {
       ep->tag.type = GACL_TAG_TYPE_USER;
       ep->tag.ugid = ap->a_who;
-      pp = getpwuid(ap->a_who);
-      if (pp) {
-	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), pp->pw_name) < 0)
+      name = ids_uid_to_name(ap->a_who);
+      if (name) {
+	if (s_cpy(ep->tag.name, sizeof(ep->tag.name), name) < 0)
 	  return -1;
       } else {
 	int rc = snprintf(ep->tag.name, sizeof(ep->tag.name), "%d", ap->a_who);
@@ -1317,8 +1450,7 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
   macos_acl_tag_t at;
   macos_acl_permset_t ops;
   macos_acl_flagset_t ofs;
-  struct passwd *pp;
-  struct group *gp;
+  const char *name;
 
   
   if (acl_get_tag_type(oep, &at) < 0)
@@ -1339,9 +1471,9 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
     switch (ugtype) {
     case ID_TYPE_UID:
       nep->tag.type = GACL_TAG_TYPE_USER;
-      pp = getpwuid(nep->tag.ugid);
-      if (pp) {
-	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), pp->pw_name) < 0)
+      name = ids_uid_to_name(nep->tag.ugid);
+      if (name) {
+	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), name) < 0)
 	  return -1;
       } else {
 	int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
@@ -1357,9 +1489,9 @@ _gacl_entry_from_acl_entry(GACL_ENTRY *nep,
       
     case ID_TYPE_GID:
       nep->tag.type = GACL_TAG_TYPE_GROUP;
-      gp = getgrgid(nep->tag.ugid);
-      if (gp) {
-	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), gp->gr_name) < 0)
+      name = ids_gid_to_name(nep->tag.ugid);
+      if (name) {
+	if (s_cpy(nep->tag.name, sizeof(nep->tag.name), name) < 0)
 	  return -1;
       } else {
 	int rc = snprintf(nep->tag.name, sizeof(nep->tag.name), "%d", nep->tag.ugid);
@@ -1600,3 +1732,38 @@ _gacl_set_fd_file(int fd,
   return -1;
 }
 #endif
+
+
+#ifndef ACL_NFS4_XATTR
+uid_t
+_gacl_resolve_tag(GACL_TAG *tp) {
+  /* Only decoded NFSv4 ACLs have unresolved tags */
+  tp->f_unresolved = 0;
+  return tp->ugid;
+}
+
+int
+gacl_encode_np(GACL *ap) {
+  /* Only Linux for now, elsewhere the ACL is converted when it is set */
+  return 0;
+}
+
+int
+_gacl_match_fd_file(int fd,
+		    const char *path,
+		    GACL_TYPE type,
+		    GACL *ap,
+		    int flags) {
+  GACL *oap;
+  int rc;
+
+
+  oap = _gacl_get_fd_file(fd, path, type, flags);
+  if (!oap)
+    return -1;
+
+  rc = gacl_match(ap, oap);
+  gacl_free(oap);
+  return rc;
+}
+#endif
@@ -97,6 +97,13 @@
 #define GACL_FREEBSD_EMULATION 1
 #define GACL_SOLARIS_EMULATION 1
 
+#define ACL_NFS4_XATTR "system.nfs4_acl"
+
+/* Decode the raw value of the ACL_NFS4_XATTR extended attribute */
+extern GACL *
+_gacl_init_from_nfs4(const char *buf,
+		     size_t bufsize);
+
 /* ---------------------------------------- Linux - END ---------------------------------------- */
 
 
@@ -151,4 +158,11 @@ _gacl_set_fd_file(int fd,
 		  GACL *ap,
 		  int flags);
 
+int
+_gacl_match_fd_file(int fd,
+		    const char *path,
+		    GACL_TYPE type,
+		    GACL *ap,
+		    int flags);
+
 #endif
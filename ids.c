@@ -0,0 +1,726 @@
+/*
+ * ids.c
+ *
+ * Copyright (c) 2019-2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ids.h"
+
+
+/* Kinds of entries: id -> name or name -> id, for users and groups */
+#define IDS_UID   0
+#define IDS_GID   1
+#define IDS_UNAME 2
+#define IDS_GNAME 3
+
+typedef struct ids_entry {
+  struct ids_entry *next;
+  int kind;
+  unsigned long id;
+  char *name;		/* NULL for unknown ids */
+  time_t expires;	/* Unknown names and ids, else 0 */
+} IDS_ENTRY;
+
+static struct {
+#if HAVE_PTHREAD_H
+  pthread_mutex_t mtx;
+#endif
+  IDS_ENTRY **v;
+  size_t size;
+  size_t n;
+  unsigned long hits;
+  unsigned long misses;
+} ids = {
+#if HAVE_PTHREAD_H
+  PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+
+/*
+ * Preloaded passwd or group table (see ids_preload()). Names are kept
+ * in a single string pool and the two open-addressed indexes hold
+ * record numbers + 1 (0 is an empty slot). Read-only once loaded, so
+ * no locking is needed for lookups.
+ */
+typedef struct ids_rec {
+  unsigned long id;
+  size_t name;		/* Offset into the string pool */
+} IDS_REC;
+
+typedef struct ids_table {
+  IDS_REC *v;
+  size_t n;
+  size_t size;
+  char *pool;
+  size_t plen;
+  size_t psize;
+  unsigned int *byid;
+  unsigned int *byname;
+  size_t hsize;
+} IDS_TABLE;
+
+static struct {
+  int f_on;
+  char *source;
+  IDS_TABLE users;
+  IDS_TABLE groups;
+  unsigned long hits;
+  unsigned long misses;
+  char **retired;	/* String pools of replaced tables */
+  size_t nretired;
+} preload;
+
+
+static size_t
+_ids_hash(int kind,
+	  unsigned long id,
+	  const char *name) {
+  size_t h = 2166136261U ^ kind;
+
+  if (name) {
+    while (*name)
+      h = (h ^ (unsigned char) *name++) * 16777619U;
+  } else
+    h = (h ^ id) * 16777619U;
+  return h ^ (h >> 15);
+}
+
+/* Must be called with the lock held */
+static IDS_ENTRY *
+_ids_find(int kind,
+	  unsigned long id,
+	  const char *name) {
+  IDS_ENTRY *ep;
+
+
+  if (!ids.size)
+    return NULL;
+
+  for (ep = ids.v[_ids_hash(kind, id, name) & (ids.size-1)]; ep; ep = ep->next)
+    if (ep->kind == kind &&
+	(kind == IDS_UNAME || kind == IDS_GNAME ?
+	 strcmp(ep->name, name) == 0 : ep->id == id))
+      return ep;
+  return NULL;
+}
+
+/* Must be called with the lock held. Returns the entry or NULL */
+static IDS_ENTRY *
+_ids_add(int kind,
+	 unsigned long id,
+	 const char *name,
+	 time_t expires) {
+  IDS_ENTRY *ep;
+  size_t i;
+
+
+  ep = _ids_find(kind, id, (kind == IDS_UNAME || kind == IDS_GNAME) ? name : NULL);
+  if (ep) {
+    /* Already known (lost a race), else refresh the unknown entry */
+    if (!ep->expires)
+      return ep;
+  } else {
+    if (ids.n >= ids.size) {
+      size_t ns = ids.size ? ids.size*2 : 1024;
+      IDS_ENTRY **nv = calloc(ns, sizeof(nv[0])), *np;
+
+      if (!nv)
+	return NULL;
+
+      for (i = 0; i < ids.size; i++)
+	for (ep = ids.v[i]; ep; ep = np) {
+	  size_t h = _ids_hash(ep->kind, ep->id,
+			       (ep->kind == IDS_UNAME || ep->kind == IDS_GNAME) ? ep->name : NULL);
+
+	  np = ep->next;
+	  ep->next = nv[h & (ns-1)];
+	  nv[h & (ns-1)] = ep;
+	}
+      free(ids.v);
+      ids.v = nv;
+      ids.size = ns;
+    }
+
+    ep = calloc(1, sizeof(*ep));
+    if (!ep)
+      return NULL;
+
+    ep->kind = kind;
+    ep->name = NULL;
+    if (kind == IDS_UNAME || kind == IDS_GNAME) {
+      ep->name = strdup(name);
+      if (!ep->name) {
+	free(ep);
+	return NULL;
+      }
+    }
+
+    i = _ids_hash(kind, id, ep->name) & (ids.size-1);
+    ep->next = ids.v[i];
+    ids.v[i] = ep;
+    ids.n++;
+  }
+
+  /* Known names are never freed (see ids_uid_to_name()) */
+  if (name && !ep->name) {
+    ep->name = strdup(name);
+    if (!ep->name)
+      return NULL;
+  }
+  ep->id = id;
+  ep->expires = expires;
+  return ep;
+}
+
+/*
+ * Look up a user or group in the passwd or group database (without
+ * holding the lock). Returns 1 if found, 0 if not and -1 on error
+ * (like an unreachable directory service, which must not be cached).
+ */
+static int
+_ids_lookup(int kind,
+	    unsigned long *idp,
+	    const char *name,
+	    char **namep) {
+  struct passwd pwb, *pp = NULL;
+  struct group grb, *gp = NULL;
+  char *buf = NULL, *nbuf;
+  size_t bufsize = 1024;
+  int rc;
+
+
+  *namep = NULL;
+  do {
+    nbuf = realloc(buf, bufsize *= 4);
+    if (!nbuf) {
+      free(buf);
+      return -1;
+    }
+    buf = nbuf;
+
+    switch (kind) {
+    case IDS_UID:
+      rc = getpwuid_r((uid_t) *idp, &pwb, buf, bufsize, &pp);
+      break;
+    case IDS_UNAME:
+      rc = getpwnam_r(name, &pwb, buf, bufsize, &pp);
+      break;
+    case IDS_GID:
+      rc = getgrgid_r((gid_t) *idp, &grb, buf, bufsize, &gp);
+      break;
+    default:
+      rc = getgrnam_r(name, &grb, buf, bufsize, &gp);
+      break;
+    }
+  } while (rc == ERANGE && bufsize < 1024*1024);
+
+  /* Some systems report unknown names and ids as ENOENT or ESRCH */
+  if (rc != 0 && rc != ENOENT && rc != ESRCH) {
+    free(buf);
+    errno = rc;
+    return -1;
+  }
+
+  if (pp) {
+    *idp = pp->pw_uid;
+    *namep = strdup(pp->pw_name);
+  } else if (gp) {
+    *idp = gp->gr_gid;
+    *namep = strdup(gp->gr_name);
+  }
+  free(buf);
+
+  if (!pp && !gp)
+    return 0;
+  return *namep ? 1 : -1;
+}
+
+static void
+_ids_table_free(IDS_TABLE *tp) {
+  free(tp->v);
+  free(tp->pool);
+  free(tp->byid);
+  free(tp->byname);
+  memset(tp, 0, sizeof(*tp));
+}
+
+/*
+ * Free a table that names have been returned from, keeping its string
+ * pool since the names must stay valid (see ids_uid_to_name()).
+ */
+static int
+_ids_table_retire(IDS_TABLE *tp) {
+  if (tp->pool) {
+    char **nv = realloc(preload.retired, (preload.nretired+1)*sizeof(nv[0]));
+
+    if (!nv)
+      return -1;
+    preload.retired = nv;
+    preload.retired[preload.nretired++] = tp->pool;
+    tp->pool = NULL;
+  }
+
+  _ids_table_free(tp);
+  return 0;
+}
+
+static int
+_ids_table_add(IDS_TABLE *tp,
+	       unsigned long id,
+	       const char *name) {
+  size_t len = strlen(name)+1;
+
+
+  if (tp->n >= tp->size) {
+    size_t ns = tp->size ? tp->size*2 : 1024;
+    IDS_REC *nv = realloc(tp->v, ns*sizeof(nv[0]));
+
+    if (!nv)
+      return -1;
+    tp->v = nv;
+    tp->size = ns;
+  }
+
+  if (tp->plen+len > tp->psize) {
+    size_t ns = tp->psize ? tp->psize*2 : 16384;
+    char *np;
+
+    while (tp->plen+len > ns)
+      ns *= 2;
+    np = realloc(tp->pool, ns);
+    if (!np)
+      return -1;
+    tp->pool = np;
+    tp->psize = ns;
+  }
+
+  memcpy(tp->pool+tp->plen, name, len);
+  tp->v[tp->n].id = id;
+  tp->v[tp->n].name = tp->plen;
+  tp->plen += len;
+  tp->n++;
+  return 0;
+}
+
+/* Build the indexes. The first record wins for duplicate ids and names */
+static int
+_ids_table_index(IDS_TABLE *tp,
+		 int kind) {
+  size_t i, h;
+  int nkind = (kind == IDS_UID ? IDS_UNAME : IDS_GNAME);
+
+
+  tp->hsize = 16;
+  while (tp->hsize < tp->n*2)
+    tp->hsize *= 2;
+
+  tp->byid = calloc(tp->hsize, sizeof(tp->byid[0]));
+  tp->byname = calloc(tp->hsize, sizeof(tp->byname[0]));
+  if (!tp->byid || !tp->byname)
+    return -1;
+
+  for (i = 0; i < tp->n; i++) {
+    for (h = _ids_hash(kind, tp->v[i].id, NULL) & (tp->hsize-1);
+	 tp->byid[h] && tp->v[tp->byid[h]-1].id != tp->v[i].id;
+	 h = (h+1) & (tp->hsize-1))
+      ;
+    if (!tp->byid[h])
+      tp->byid[h] = i+1;
+
+    for (h = _ids_hash(nkind, 0, tp->pool+tp->v[i].name) & (tp->hsize-1);
+	 tp->byname[h] && strcmp(tp->pool+tp->v[tp->byname[h]-1].name,
+				 tp->pool+tp->v[i].name) != 0;
+	 h = (h+1) & (tp->hsize-1))
+      ;
+    if (!tp->byname[h])
+      tp->byname[h] = i+1;
+  }
+
+  return 0;
+}
+
+/* Returns the record, or NULL if the id or name is not in the table */
+static IDS_REC *
+_ids_table_find(IDS_TABLE *tp,
+		int kind,
+		unsigned long id,
+		const char *name) {
+  size_t h;
+  unsigned int r;
+
+
+  if (!tp->hsize)
+    return NULL;
+
+  if (name) {
+    for (h = _ids_hash(kind, 0, name) & (tp->hsize-1);
+	 (r = tp->byname[h]) != 0;
+	 h = (h+1) & (tp->hsize-1))
+      if (strcmp(tp->pool+tp->v[r-1].name, name) == 0)
+	return &tp->v[r-1];
+  } else {
+    for (h = _ids_hash(kind, id, NULL) & (tp->hsize-1);
+	 (r = tp->byid[h]) != 0;
+	 h = (h+1) & (tp->hsize-1))
+      if (tp->v[r-1].id == id)
+	return &tp->v[r-1];
+  }
+
+  return NULL;
+}
+
+/* Enumerate the passwd or group database */
+static int
+_ids_load_nss(IDS_TABLE *tp,
+	      int kind) {
+  struct passwd *pp;
+  struct group *gp;
+  int rc = 0;
+
+
+  if (kind == IDS_UID) {
+    setpwent();
+    while (rc == 0 && (pp = getpwent()) != NULL)
+      rc = _ids_table_add(tp, pp->pw_uid, pp->pw_name);
+    endpwent();
+  } else {
+    setgrent();
+    while (rc == 0 && (gp = getgrent()) != NULL)
+      rc = _ids_table_add(tp, gp->gr_gid, gp->gr_name);
+    endgrent();
+  }
+
+  return rc;
+}
+
+/* Load a file in passwd(5) or group(5) format (name:password:id:...) */
+static int
+_ids_load_file(IDS_TABLE *tp,
+	       const char *path) {
+  FILE *fp;
+  char buf[4096], *name, *cp, *ep;
+  unsigned long id;
+  size_t len;
+  int rc = 0, f_long = 0;
+
+
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  while (rc == 0 && fgets(buf, sizeof(buf), fp)) {
+    /* Only the first fields are needed, skip the rest of long lines */
+    len = strlen(buf);
+    if (f_long) {
+      f_long = (len > 0 && buf[len-1] != '\n');
+      continue;
+    }
+    f_long = (len > 0 && buf[len-1] != '\n');
+
+    /* Skip comments and NIS compat (+/-) entries */
+    if (buf[0] == '#' || buf[0] == '+' || buf[0] == '-')
+      continue;
+
+    name = buf;
+    cp = strchr(name, ':');
+    if (!cp || cp == name)
+      continue;
+    *cp++ = '\0';
+
+    cp = strchr(cp, ':');
+    if (!cp)
+      continue;
+    ++cp;
+
+    id = strtoul(cp, &ep, 10);
+    if (ep == cp || (*ep != ':' && *ep != '\n' && *ep != '\0'))
+      continue;
+
+    rc = _ids_table_add(tp, id, name);
+  }
+
+  if (ferror(fp))
+    rc = -1;
+  fclose(fp);
+  return rc;
+}
+
+int
+ids_preload(const char *source) {
+  char *pwfile = NULL, *grfile = NULL, *cp;
+  int rc = 0;
+
+
+  if (!source) {
+    preload.f_on = 0;
+    return 0;
+  }
+
+  /* Already loaded from the same source? */
+  if (preload.source && strcmp(preload.source, source) == 0) {
+    preload.f_on = 1;
+    return 0;
+  }
+
+  preload.f_on = 0;
+  free(preload.source);
+  preload.source = NULL;
+  if (_ids_table_retire(&preload.users) < 0 ||
+      _ids_table_retire(&preload.groups) < 0)
+    return -1;
+
+  if (*source) {
+    pwfile = strdup(source);
+    if (!pwfile)
+      return -1;
+    cp = strchr(pwfile, ',');
+    if (cp) {
+      *cp++ = '\0';
+      grfile = cp;
+    }
+  }
+
+  if (pwfile && *pwfile)
+    rc = _ids_load_file(&preload.users, pwfile);
+  else
+    rc = _ids_load_nss(&preload.users, IDS_UID);
+
+  if (rc == 0) {
+    if (grfile && *grfile)
+      rc = _ids_load_file(&preload.groups, grfile);
+    else
+      rc = _ids_load_nss(&preload.groups, IDS_GID);
+  }
+
+  if (rc == 0)
+    rc = _ids_table_index(&preload.users, IDS_UID);
+  if (rc == 0)
+    rc = _ids_table_index(&preload.groups, IDS_GID);
+  if (rc == 0) {
+    preload.source = strdup(source);
+    if (!preload.source)
+      rc = -1;
+  }
+
+  free(pwfile);
+  if (rc < 0) {
+    int ec = errno;
+
+    _ids_table_free(&preload.users);
+    _ids_table_free(&preload.groups);
+    errno = ec;
+    return -1;
+  }
+
+  preload.f_on = 1;
+  return 0;
+}
+
+/*
+ * Look up an id (if name is NULL) or a name. Returns 1 if found (with
+ * the id and name), 0 if not (with errno set to 0) and -1 on errors.
+ */
+static int
+_ids_get(int kind,
+	 unsigned long *idp,
+	 const char *name,
+	 const char **namep) {
+  IDS_ENTRY *ep;
+  time_t now = 0, expires = 0;
+  unsigned long id = *idp;
+  const char *ename = NULL;
+  char *rname;
+  int rc;
+
+
+  /* The preloaded tables are authoritative, NSS is never asked */
+  if (preload.f_on) {
+    IDS_TABLE *tp = (kind == IDS_UID || kind == IDS_UNAME) ? &preload.users : &preload.groups;
+    IDS_REC *rp = _ids_table_find(tp, kind, id, name);
+
+    if (!rp) {
+      __atomic_fetch_add(&preload.misses, 1, __ATOMIC_RELAXED);
+      errno = 0;
+      return 0;
+    }
+    __atomic_fetch_add(&preload.hits, 1, __ATOMIC_RELAXED);
+    *idp = rp->id;
+    *namep = tp->pool+rp->name;
+    return 1;
+  }
+
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&ids.mtx);
+#endif
+  ep = _ids_find(kind, id, name);
+  if (ep && ep->expires && ep->expires < (now = time(NULL)))
+    ep = NULL;
+  if (ep) {
+    /* Entries may be updated by other threads once unlocked */
+    expires = ep->expires;
+    id = ep->id;
+    ename = ep->name;
+    ids.hits++;
+  } else
+    ids.misses++;
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&ids.mtx);
+#endif
+  if (ep) {
+    if (expires) {
+      errno = 0;
+      return 0;
+    }
+    *idp = id;
+    *namep = ename;
+    return 1;
+  }
+
+  rc = _ids_lookup(kind, &id, name, &rname);
+  if (rc < 0)
+    return -1;
+
+  if (!now)
+    now = time(NULL);
+
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&ids.mtx);
+#endif
+  if (rc == 0)
+    ep = _ids_add(kind, id, name, now+IDS_NEGATIVE_TTL);
+  else {
+    /* Remember both directions */
+    if (kind == IDS_UID || kind == IDS_UNAME) {
+      ep = _ids_add(IDS_UID, id, rname, 0);
+      if (ep)
+	(void) _ids_add(IDS_UNAME, id, rname, 0);
+    } else {
+      ep = _ids_add(IDS_GID, id, rname, 0);
+      if (ep)
+	(void) _ids_add(IDS_GNAME, id, rname, 0);
+    }
+    /* A name may be an alias for the canonical name */
+    if (ep && name && strcmp(name, rname) != 0)
+      (void) _ids_add(kind, id, name, 0);
+  }
+  if (ep) {
+    expires = ep->expires;
+    id = ep->id;
+    ename = ep->name;
+  }
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&ids.mtx);
+#endif
+  free(rname);
+
+  if (!ep)
+    return -1;
+  if (expires) {
+    errno = 0;
+    return 0;
+  }
+  *idp = id;
+  *namep = ename;
+  return 1;
+}
+
+
+const char *
+ids_uid_to_name(uid_t uid) {
+  unsigned long id = uid;
+  const char *name;
+
+
+  return _ids_get(IDS_UID, &id, NULL, &name) > 0 ? name : NULL;
+}
+
+const char *
+ids_gid_to_name(gid_t gid) {
+  unsigned long id = gid;
+  const char *name;
+
+
+  return _ids_get(IDS_GID, &id, NULL, &name) > 0 ? name : NULL;
+}
+
+int
+ids_name_to_uid(const char *name,
+		uid_t *uidp) {
+  unsigned long id = 0;
+  const char *rname;
+
+
+  if (_ids_get(IDS_UNAME, &id, name, &rname) <= 0)
+    return 0;
+  *uidp = (uid_t) id;
+  return 1;
+}
+
+int
+ids_name_to_gid(const char *name,
+		gid_t *gidp) {
+  unsigned long id = 0;
+  const char *rname;
+
+
+  if (_ids_get(IDS_GNAME, &id, name, &rname) <= 0)
+    return 0;
+  *gidp = (gid_t) id;
+  return 1;
+}
+
+void
+ids_stats(unsigned long *hits,
+	  unsigned long *misses) {
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&ids.mtx);
+#endif
+  *hits = ids.hits + __atomic_load_n(&preload.hits, __ATOMIC_RELAXED);
+  *misses = ids.misses + __atomic_load_n(&preload.misses, __ATOMIC_RELAXED);
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&ids.mtx);
+#endif
+}
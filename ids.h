@@ -0,0 +1,79 @@
+/*
+ * ids.h
+ *
+ * Copyright (c) 2019-2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IDS_H
+#define IDS_H 1
+
+#include <sys/types.h>
+
+/*
+ * Cached user and group lookups. The passwd and group databases (NSS)
+ * are only asked once per name or id, and unknown names and ids are
+ * remembered for IDS_NEGATIVE_TTL seconds.
+ */
+
+#define IDS_NEGATIVE_TTL 60
+
+/*
+ * Returned names are valid for the life of the process. If not found
+ * errno is 0 for unknown ids and names, else the lookup error.
+ */
+extern const char *
+ids_uid_to_name(uid_t uid);
+
+extern const char *
+ids_gid_to_name(gid_t gid);
+
+/* Returns 1 if found, else 0 */
+extern int
+ids_name_to_uid(const char *name,
+		uid_t *uidp);
+
+extern int
+ids_name_to_gid(const char *name,
+		gid_t *gidp);
+
+/*
+ * Load the whole passwd and group databases into memory, and only
+ * use them (no NSS lookups) until called again with a NULL source.
+ * The source is "" to enumerate NSS (getpwent/getgrent), or
+ * "<passwd-file>[,<group-file>]" (an empty file name enumerates NSS).
+ */
+extern int
+ids_preload(const char *source);
+
+extern void
+ids_stats(unsigned long *hits,
+	  unsigned long *misses);
+
+#endif
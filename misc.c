@@ -45,8 +45,17 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <termios.h>
+#include <setjmp.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "acltool.h"
+#include "ids.h"
 
 #define NEW(vp) ((vp) = malloc(sizeof(*(vp))))
 
@@ -407,8 +416,9 @@ ace2str_samba(gacl_entry_t ae,
   gacl_flagset_t afs;
   gacl_entry_type_t aet;
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  const char *un, *gn;
+  uid_t uid;
+  gid_t gid;
   int rc;
   
 
@@ -428,14 +438,13 @@ ace2str_samba(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp) {
-      gp = getgrnam(pp->pw_name);
-      rc = snprintf(res, rsize, "ACL:%s%s:", pp->pw_name, gp ? "(user)" : "");
-    } else {
-      gp = getgrgid(*(gid_t *) qp);
-      rc = snprintf(res, rsize, "ACL:%u%s:", * (uid_t *) qp, gp ? "(user)" : "");
-    }
+    un = ids_uid_to_name(*(uid_t *) qp);
+    if (un)
+      rc = snprintf(res, rsize, "ACL:%s%s:", un,
+		    ids_name_to_gid(un, &gid) ? "(user)" : "");
+    else
+      rc = snprintf(res, rsize, "ACL:%u%s:", * (uid_t *) qp,
+		    ids_gid_to_name(*(gid_t *) qp) ? "(user)" : "");
     gacl_free(qp);
     break;
     
@@ -444,32 +453,31 @@ ace2str_samba(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp) { 
-      pp = getpwnam(gp->gr_name);
-      rc = snprintf(res, rsize, "ACL:%s%s:", gp->gr_name, pp ? "(group)" : "");
-    } else {
-      pp = getpwuid(*(uid_t *) qp);
-      rc = snprintf(res, rsize, "ACL:%u%s:", * (gid_t *) qp, pp ? "(group)" : "");
-    }
+    gn = ids_gid_to_name(*(gid_t *) qp);
+    if (gn)
+      rc = snprintf(res, rsize, "ACL:%s%s:", gn,
+		    ids_name_to_uid(gn, &uid) ? "(group)" : "");
+    else
+      rc = snprintf(res, rsize, "ACL:%u%s:", * (gid_t *) qp,
+		    ids_uid_to_name(*(uid_t *) qp) ? "(group)" : "");
     gacl_free(qp);
     break;
     
   case GACL_TAG_TYPE_USER_OBJ:
-    pp = getpwuid(sp->st_uid);
-    if (pp)
-      rc = snprintf(res, rsize, "ACL:%s:", pp->pw_name);
+    un = ids_uid_to_name(sp->st_uid);
+    if (un)
+      rc = snprintf(res, rsize, "ACL:%s:", un);
     else
       rc = snprintf(res, rsize, "ACL:%u:", sp->st_uid);
     break;
     
   case GACL_TAG_TYPE_GROUP_OBJ:
-    gp = getgrgid(sp->st_gid);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "ACL:GROUP=%s:", gp->gr_name);
+    gn = ids_gid_to_name(sp->st_gid);
+    if (gn) {
+      if (ids_name_to_uid(gn, &uid))
+	rc = snprintf(res, rsize, "ACL:GROUP=%s:", gn);
       else
-	rc = snprintf(res, rsize, "ACL:%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "ACL:%s:", gn);
     } else
       rc = snprintf(res, rsize, "ACL:GID=%u:", sp->st_gid);
     break;
@@ -570,8 +578,8 @@ ace2str_icacls(gacl_entry_t ae,
   gacl_entry_type_t aet;
 #endif
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  const char *un, *gn;
+  uid_t uid;
   int rc;
   
 
@@ -591,9 +599,9 @@ ace2str_icacls(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp)
-      rc = snprintf(res, rsize, "%s:", pp->pw_name);
+    un = ids_uid_to_name(*(uid_t *) qp);
+    if (un)
+      rc = snprintf(res, rsize, "%s:", un);
     else
       rc = snprintf(res, rsize, "%u:", * (uid_t *) qp);
     gacl_free(qp);
@@ -604,32 +612,32 @@ ace2str_icacls(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "GROUP=%s:", gp->gr_name);
+    gn = ids_gid_to_name(*(gid_t *) qp);
+    if (gn) {
+      if (ids_name_to_uid(gn, &uid))
+	rc = snprintf(res, rsize, "GROUP=%s:", gn);
       else
-	rc = snprintf(res, rsize, "%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "%s:", gn);
     } else
       rc = snprintf(res, rsize, "GID=%u:", * (gid_t *) qp);
     gacl_free(qp);
     break;
     
   case GACL_TAG_TYPE_USER_OBJ:
-    pp = getpwuid(sp->st_uid);
-    if (pp)
-      rc = snprintf(res, rsize, "%s:", pp->pw_name);
+    un = ids_uid_to_name(sp->st_uid);
+    if (un)
+      rc = snprintf(res, rsize, "%s:", un);
     else
       rc = snprintf(res, rsize, "%u:", sp->st_uid);
     break;
     
   case GACL_TAG_TYPE_GROUP_OBJ:
-    gp = getgrgid(sp->st_gid);
-    if (gp) {
-      if (getpwnam(gp->gr_name))
-	rc = snprintf(res, rsize, "GROUP=%s:", gp->gr_name);
+    gn = ids_gid_to_name(sp->st_gid);
+    if (gn) {
+      if (ids_name_to_uid(gn, &uid))
+	rc = snprintf(res, rsize, "GROUP=%s:", gn);
       else
-	rc = snprintf(res, rsize, "%s:", gp->gr_name);
+	rc = snprintf(res, rsize, "%s:", gn);
     } else
       rc = snprintf(res, rsize, "GID=%u:", sp->st_gid);
     break;
@@ -716,8 +724,7 @@ ace2str(gacl_entry_t ae,
   gacl_flagset_t afs;
   gacl_entry_type_t aet;
   void *qp = NULL;
-  struct passwd *pp = NULL;
-  struct group *gp = NULL;
+  const char *un, *gn;
   int rc;
   
 
@@ -737,9 +744,9 @@ ace2str(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    pp = getpwuid(*(uid_t *) qp);
-    if (pp)
-      rc = snprintf(res, rsize, "u:%s", pp->pw_name);
+    un = ids_uid_to_name(*(uid_t *) qp);
+    if (un)
+      rc = snprintf(res, rsize, "u:%s", un);
     else
       rc = snprintf(res, rsize, "u:%u", * (uid_t *) qp);
     gacl_free(qp);
@@ -750,9 +757,9 @@ ace2str(gacl_entry_t ae,
     if (!qp)
       return NULL;
 
-    gp = getgrgid(*(gid_t *) qp);
-    if (gp)
-      rc = snprintf(res, rsize, "g:%s", gp->gr_name);
+    gn = ids_gid_to_name(*(gid_t *) qp);
+    if (gn)
+      rc = snprintf(res, rsize, "g:%s", gn);
     else
       rc = snprintf(res, rsize, "g:%u", * (gid_t *) qp);
     gacl_free(qp);
@@ -831,159 +838,2325 @@ ace2str(gacl_entry_t ae,
 
 
 
-typedef struct ftdcb {
-  char *path;
-  struct stat stat;
-  size_t base;
-  size_t level;
-  struct ftdcb *next;
-} FTDCB;
+/*
+ * Path buffer reused while walking a tree, so the full path for each
+ * object is built in place instead of being allocated per entry.
+ */
+typedef struct ftpath {
+  char *buf;
+  size_t len;
+  size_t size;
+} FTPATH;
+
+static int
+_ftpath_set(FTPATH *pp,
+	    size_t plen,
+	    const char *name) {
+  size_t nlen = strlen(name);
+
+
+  if (plen+nlen+2 > pp->size) {
+    size_t ns = pp->size ? pp->size : 256;
+    char *nb;
+
+    while (plen+nlen+2 > ns)
+      ns *= 2;
+    nb = realloc(pp->buf, ns);
+    if (!nb)
+      return -1;
+    pp->buf = nb;
+    pp->size = ns;
+  }
+
+  pp->buf[plen] = '/';
+  memcpy(pp->buf+plen+1, name, nlen+1);
+  pp->len = plen+nlen+1;
+  return 0;
+}
 
-typedef struct ftcb {
-  FTDCB *head;
-  FTDCB **lastp;
-} FTCB;
 
+/*
+ * A batch of directory entries. Reading a directory in batches makes
+ * it possible to process each batch in inode number order, which avoids
+ * random metadata I/O on filesystems that lay out inodes on disk in
+ * that order.
+ */
+#define FT_BATCH_MAX 4096
 
-static void
-_ftcb_init(FTCB *ftcb) {
-  ftcb->head = NULL;
-  ftcb->lastp = &ftcb->head;
+typedef struct ftbatch {
+  VFS_DIRENT *v;
+  double *w;	/* Sampling weights (if sampling) */
+  size_t seen;	/* Sampling candidates seen in the directory */
+  int c;
+} FTBATCH;
+
+
+/*
+ * Sampling (--sample and --sample-per-dir). Entries known from readdir()
+ * to be non-directories are visited with a probability p and dropped
+ * from the batch otherwise, before anything is looked up for them. The
+ * decision is a seeded hash of the path, so the same subset is selected
+ * every time (for --sample-per-dir as long as the directories are
+ * unchanged). Directories and entries of unknown type are always visited.
+ *
+ * With --sample-per-dir N the i:th candidate of a directory is visited
+ * with probability N/i (all of the first N), so about N*(1+ln(n/N)) of
+ * n entries are visited, without knowing n in advance.
+ *
+ * Each object passed to the walker has the weight 1/p (available with
+ * ft_sample_weight()) for unbiased (Horvitz-Thompson) estimates.
+ */
+static struct {
+  int f_on;
+  double rate;
+  unsigned int per_dir;
+  unsigned long long seed;
+} ft_sample = { 0, 1.0, 0, 0 };
+
+static __thread double ft_weight = 1.0;
+
+void
+ft_sample_set(double rate,
+	      unsigned int per_dir,
+	      unsigned long seed) {
+  ft_sample.rate = (rate > 0 && rate < 1 ? rate : 1.0);
+  ft_sample.per_dir = per_dir;
+  ft_sample.seed = seed;
+  ft_sample.f_on = (ft_sample.rate < 1 || per_dir > 0);
 }
 
-static void
-_ftcb_destroy(FTCB *ftcb) {
-  FTDCB *ftdcb, *next;
+double
+ft_sample_weight(void) {
+  return ft_weight;
+}
 
-  for (ftdcb = ftcb->head; ftdcb; ftdcb = next) {
-    next = ftdcb->next;
-    
-    free(ftdcb->path);
-    free(ftdcb);
+/* Uniform [0,1) value for the path dir/name */
+static double
+_ftsample_hash(const char *dir,
+	       size_t dlen,
+	       const char *name) {
+  unsigned long long h = 14695981039346656037ULL ^ ft_sample.seed;
+  size_t i;
+
+
+  for (i = 0; i < dlen; i++)
+    h = (h ^ (unsigned char) dir[i]) * 1099511628211ULL;
+  h = (h ^ '/') * 1099511628211ULL;
+  while (*name)
+    h = (h ^ (unsigned char) *name++) * 1099511628211ULL;
+
+  /* FNV-1a has weak high bits, mix them (splitmix64 finalizer) */
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return (h >> 11) * (1.0/9007199254740992.0);
+}
+
+/* Drop the entries not selected from a batch. Returns the new size or -1 */
+static int
+_ftsample_batch(FTBATCH *bp,
+		int n,
+		const char *dir,
+		size_t dlen) {
+  int i, j;
+  double p;
+
+
+  if (!bp->w) {
+    bp->w = malloc(FT_BATCH_MAX * sizeof(bp->w[0]));
+    if (!bp->w)
+      return -1;
+  }
+
+  for (i = j = 0; i < n; i++) {
+    VFS_DIRENT *dep = &bp->v[i];
+
+    p = 1.0;
+    if (dep->d_type && !S_ISDIR(dep->d_type)) {
+      p = ft_sample.rate;
+      if (ft_sample.per_dir && ++bp->seen > ft_sample.per_dir)
+	p *= (double) ft_sample.per_dir / bp->seen;
+      if (_ftsample_hash(dir, dlen, dep->d_name) >= p)
+	continue;
+    }
+    if (i != j)
+      bp->v[j] = bp->v[i];
+    bp->w[j++] = 1.0/p;
   }
+
+  return j;
 }
 
+static int
+_ftbent_compare(const void *a,
+		const void *b) {
+  const VFS_DIRENT *x = (const VFS_DIRENT *) a;
+  const VFS_DIRENT *y = (const VFS_DIRENT *) b;
 
-int
-_ft_foreach(const char *path,
-	    struct stat *stat,
-	    int (*walker)(const char *path,
-			  const struct stat *stat,
-			  size_t base,
-			  size_t level,
-			  void *vp),
-	    void *vp,
-	    size_t curlevel,
-	    size_t maxlevel,
-	    mode_t filetypes) {
-  FTCB ftcb;
-  FTDCB *ftdcb;
-  DIR *dp;
-  struct dirent *dep;
-  int rc;
-  struct stat sb;
-  size_t plen;
+  if (x->d_ino != y->d_ino)
+    return x->d_ino < y->d_ino ? -1 : 1;
 
-  
-  if (!filetypes || (stat->st_mode & filetypes))
-    rc = walker(path, stat, 0, curlevel, vp);
-  else
-    rc = 0;
-  if (rc < 0)
-    return rc;
+  /* Keep directory order for equal (unknown) inode numbers */
+  return x->d_name < y->d_name ? -1 : (x->d_name > y->d_name);
+}
 
-  if (!S_ISDIR(stat->st_mode) || (maxlevel >= 0 && curlevel == maxlevel))
-    return 0;
+/* Returns the number of entries read (0 at end of directory) or -1 */
+static int
+_ftbatch_read(FTBATCH *bp,
+	      VFS_DIR *dp,
+	      int f_sort,
+	      const char *dir,
+	      size_t dlen) {
+  int i, j, n;
 
-  ++curlevel;
-  
-  _ftcb_init(&ftcb);
-  plen = strlen(path);
-  
-  dp = vfs_opendir(path);
-  if (!dp)
-    return -1;
-  
-  while ((dep = vfs_readdir(dp)) != NULL) {
-    char *fpath;
+
+  if (!bp->v) {
+    bp->v = malloc(FT_BATCH_MAX * sizeof(bp->v[0]));
+    if (!bp->v)
+      return -1;
+  }
+
+  do {
+    n = vfs_readdir_batch(dp, bp->v, FT_BATCH_MAX);
+    if (n <= 0)
+      return bp->c = n;
 
     /* Ignore . and .. */
-    if (strcmp(dep->d_name, ".") == 0 ||
-	strcmp(dep->d_name, "..") == 0)
-      continue;
-    
-    fpath = s_dupcat(path, "/", dep->d_name, NULL);
-    if (!fpath) {
-      rc = -1;
-      goto End;
+    for (i = j = 0; i < n; i++) {
+      const char *name = bp->v[i].d_name;
+
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+	continue;
+      if (i != j)
+	bp->v[j] = bp->v[i];
+      j++;
     }
 
-    if (vfs_lstat(fpath, &sb) < 0) {
-      free(fpath);
-      rc = -1;
-      goto End;
+    if (f_sort && j > 1)
+      qsort(bp->v, j, sizeof(bp->v[0]), _ftbent_compare);
+
+    if (ft_sample.f_on && j > 0 &&
+	(j = _ftsample_batch(bp, j, dir, dlen)) < 0)
+      return bp->c = -1;
+  } while (j == 0);
+
+  return bp->c = j;
+}
+
+static void
+_ftbatch_free(FTBATCH *bp) {
+  free(bp->v);
+  bp->v = NULL;
+  free(bp->w);
+  bp->w = NULL;
+  bp->c = 0;
+}
+
+
+/*
+ * Compiled set of --exclude or --prune patterns, matched against the
+ * names of directory entries. Plain names (the common case) are looked
+ * up in a hash table, patterns with wildcards are matched with fnmatch()
+ * and patterns containing a '/' are matched against the full path.
+ * The sets are compiled when a walk starts with a changed pattern list
+ * and are only read during the walk.
+ */
+typedef struct ftmatch {
+  SLIST *src;
+  char **names;		/* Open addressed, power of 2 size */
+  size_t size;
+  char **globs;
+  size_t ng;
+  char **paths;
+  size_t np;
+} FTMATCH;
+
+static FTMATCH ft_exclude = { NULL, NULL, 0, NULL, 0, NULL, 0 };
+static FTMATCH ft_prune   = { NULL, NULL, 0, NULL, 0, NULL, 0 };
+
+static size_t
+_ftmatch_hash(const char *s) {
+  size_t h = 2166136261U;
+
+  while (*s)
+    h = (h ^ (unsigned char) *s++) * 16777619U;
+  return h;
+}
+
+static void
+_ftmatch_free(FTMATCH *mp) {
+  free(mp->names);
+  free(mp->globs);
+  free(mp->paths);
+  memset(mp, 0, sizeof(*mp));
+}
+
+static int
+_ftmatch_compile(FTMATCH *mp,
+		 SLIST *sp) {
+  size_t i, j;
+
+
+  _ftmatch_free(mp);
+  mp->src = sp;
+  if (!sp || sp->c == 0)
+    return 0;
+
+  for (mp->size = 16; mp->size < sp->c*2; mp->size *= 2)
+    ;
+  mp->names = calloc(mp->size, sizeof(char *));
+  mp->globs = calloc(sp->c, sizeof(char *));
+  mp->paths = calloc(sp->c, sizeof(char *));
+  if (!mp->names || !mp->globs || !mp->paths) {
+    _ftmatch_free(mp);
+    return -1;
+  }
+
+  for (i = 0; i < sp->c; i++) {
+    char *pat = sp->v[i];
+
+    if (strchr(pat, '/'))
+      mp->paths[mp->np++] = pat;
+    else if (strpbrk(pat, "*?[\\"))
+      mp->globs[mp->ng++] = pat;
+    else {
+      j = _ftmatch_hash(pat) & (mp->size-1);
+      while (mp->names[j])
+	j = (j+1) & (mp->size-1);
+      mp->names[j] = pat;
     }
+  }
 
-    /* Add to queue if directory */
-    if (S_ISDIR(sb.st_mode)) {
-      FTDCB *ftdcb;
+  return 0;
+}
 
+/* Returns 1 if 'name' (or 'path', if not NULL) matches the set */
+static int
+_ftmatch(FTMATCH *mp,
+	 const char *name,
+	 const char *path) {
+  size_t i;
 
-      if (NEW(ftdcb) == NULL) {
-	rc = -1;
-	goto End;
+
+  if (!mp->size)
+    return 0;
+
+  i = _ftmatch_hash(name) & (mp->size-1);
+  while (mp->names[i]) {
+    if (strcmp(mp->names[i], name) == 0)
+      return 1;
+    i = (i+1) & (mp->size-1);
+  }
+
+  for (i = 0; i < mp->ng; i++)
+    if (fnmatch(mp->globs[i], name, 0) == 0)
+      return 1;
+
+  for (i = 0; path && i < mp->np; i++)
+    if (fnmatch(mp->paths[i], path, FNM_PATHNAME) == 0)
+      return 1;
+
+  return 0;
+}
+
+
+/*
+ * Check if a directory that is not on the same filesystem as the root of
+ * the walk ('rdev') should be skipped (--one-filesystem/--prune-fstype).
+ * The result for the last device seen is cached per thread, so the type
+ * is normally only looked up once per mount point.
+ */
+static __thread struct {
+  dev_t dev;
+  const char *list;
+  int skip;
+} ft_fst = { 0, NULL, 0 };
+
+static int
+_ft_pruned(dev_t rdev,
+	   const char *path,
+	   const struct stat *sp) {
+  char tbuf[256];
+  const char *cp;
+  size_t len;
+
+
+  if (sp->st_dev == rdev)
+    return 0;
+  if (config.f_xdev)
+    return 1;
+  if (!config.prune_fstypes)
+    return 0;
+
+  if (ft_fst.list == config.prune_fstypes && ft_fst.dev == sp->st_dev)
+    return ft_fst.skip;
+
+  ft_fst.skip = 0;
+  if (vfs_fstype(path, sp, tbuf, sizeof(tbuf)) == 0) {
+    len = strlen(tbuf);
+    for (cp = config.prune_fstypes; *cp; cp += strcspn(cp, ",")) {
+      if (*cp == ',')
+	++cp;
+      if (strncmp(cp, tbuf, len) == 0 && (cp[len] == ',' || cp[len] == '\0')) {
+	ft_fst.skip = 1;
+	break;
       }
-      
-      ftdcb->path = fpath;
-      ftdcb->base = plen+1;
-      ftdcb->stat = sb;
-      ftdcb->next = NULL;
-      
-      *(ftcb.lastp) = ftdcb;
-      ftcb.lastp = &ftdcb->next;
-    }
-    else {
-      if (!filetypes || (sb.st_mode & filetypes))
-	rc = walker(fpath, &sb, 0, curlevel, vp);
-      else
-	rc = 0;
-      free(fpath);
-      if (rc)
-	goto End;
     }
   }
+  ft_fst.dev = sp->st_dev;
+  ft_fst.list = config.prune_fstypes;
+  return ft_fst.skip;
+}
 
-  vfs_closedir(dp);
-  dp = NULL;
-  
-  for (ftdcb = ftcb.head; ftdcb; ftdcb = ftdcb->next) {
-    rc = _ft_foreach(ftdcb->path, &ftdcb->stat, walker, vp, curlevel, maxlevel, filetypes);
-    if (rc)
+
+static int
+_ftfilter_skip(const struct stat *sp);
+
+
+#if HAVE_PTHREAD_H
+/*
+ * Metadata prefetching for the serial walker (--prefetch). Helper
+ * threads lstat (and read the ACL of) the entries of the directory batch
+ * being processed a bit ahead of the walking thread, which then picks up
+ * the results in order. The walker callbacks all still run in the
+ * walking thread and see the objects in the same order as without it.
+ */
+#define FTPF_AHEAD  4		/* Entries in flight per helper thread */
+
+#define FTPF_QUEUED 0
+#define FTPF_BUSY   1
+#define FTPF_DONE   2
+
+typedef struct ftpfent {
+  int state;
+  int rc;		/* 0 = prefetched */
+  struct stat sb;
+  GACL *acl;
+} FTPFENT;
+
+typedef struct ftprefetch {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  FTPFENT *v;
+  VFS_DIRENT *dv;
+  char *dir;		/* Path of the directory, for exclude patterns */
+  size_t dsize;
+  size_t n;
+  size_t next;		/* Next entry for a helper to take */
+  size_t limit;		/* Helpers only take entries below this */
+  size_t window;
+  size_t busy;
+  int fd;
+  mode_t filetypes;
+  int f_stop;
+  unsigned int nt;
+  pthread_t *tv;
+} FTPREFETCH;
+
+static void
+_ftprefetch_entry(FTPREFETCH *pf,
+		  size_t i) {
+  FTPFENT *ep = &pf->v[i];
+  VFS_DIRENT *dep = &pf->dv[i];
+  mode_t ftype = dep->d_type;
+
+
+  ep->rc = -1;
+  ep->acl = NULL;
+
+  /* Same checks as in _ft_foreach_dir() for objects that are not stat'ed */
+  if (ftype && (S_ISDIR(ftype) || (pf->filetypes && !(ftype & pf->filetypes))))
+    return;
+  if (ft_exclude.size) {
+    char *path = NULL;
+    int m;
+
+    if (ft_exclude.np && !(path = s_dupcat(pf->dir, "/", dep->d_name, NULL)))
+      return;
+    m = _ftmatch(&ft_exclude, dep->d_name, path);
+    free(path);
+    if (m)
+      return;
+  }
+
+  if (vfs_lstatat(pf->fd, dep->d_name, &ep->sb) < 0)
+    return;
+  ep->rc = 0;
+
+  /* Not for objects the walker filters will drop (see _ftfilter_walker()) */
+  if (!S_ISDIR(ep->sb.st_mode) && !S_ISLNK(ep->sb.st_mode) &&
+      (!pf->filetypes || (ep->sb.st_mode & pf->filetypes)) &&
+      !_ftfilter_skip(&ep->sb)) {
+    vfs_throttle(0, 1);
+    ep->acl = gacl_get_fileat_np(pf->fd, dep->d_name, GACL_TYPE_NFS4, 0);
+  }
+}
+
+static void *
+_ftprefetch_thread(void *vp) {
+  FTPREFETCH *pf = (FTPREFETCH *) vp;
+  size_t i;
+
+
+  pthread_mutex_lock(&pf->mtx);
+  for (;;) {
+    while (!pf->f_stop && pf->next >= pf->limit)
+      pthread_cond_wait(&pf->work, &pf->mtx);
+    if (pf->f_stop)
+      break;
+
+    i = pf->next++;
+    pf->v[i].state = FTPF_BUSY;
+    pf->busy++;
+    pthread_mutex_unlock(&pf->mtx);
+
+    _ftprefetch_entry(pf, i);
+
+    pthread_mutex_lock(&pf->mtx);
+    pf->v[i].state = FTPF_DONE;
+    pf->busy--;
+    pthread_cond_broadcast(&pf->done);
+  }
+  pthread_mutex_unlock(&pf->mtx);
+  return NULL;
+}
+
+static void
+_ftprefetch_free(FTPREFETCH *pf) {
+  unsigned int i;
+
+
+  if (!pf)
+    return;
+
+  pthread_mutex_lock(&pf->mtx);
+  pf->f_stop = 1;
+  pthread_cond_broadcast(&pf->work);
+  pthread_mutex_unlock(&pf->mtx);
+
+  for (i = 0; i < pf->nt; i++)
+    pthread_join(pf->tv[i], NULL);
+
+  pthread_mutex_destroy(&pf->mtx);
+  pthread_cond_destroy(&pf->work);
+  pthread_cond_destroy(&pf->done);
+  free(pf->dir);
+  free(pf->tv);
+  free(pf->v);
+  free(pf);
+}
+
+static FTPREFETCH *
+_ftprefetch_new(unsigned int nt,
+		mode_t filetypes) {
+  FTPREFETCH *pf;
+
+
+  pf = calloc(1, sizeof(*pf));
+  if (!pf)
+    return NULL;
+
+  pf->v = calloc(FT_BATCH_MAX, sizeof(pf->v[0]));
+  pf->tv = calloc(nt, sizeof(pf->tv[0]));
+  if (!pf->v || !pf->tv) {
+    free(pf->v);
+    free(pf->tv);
+    free(pf);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pf->mtx, NULL);
+  pthread_cond_init(&pf->work, NULL);
+  pthread_cond_init(&pf->done, NULL);
+  pf->window = nt*FTPF_AHEAD;
+  pf->filetypes = filetypes;
+
+  for (pf->nt = 0; pf->nt < nt; pf->nt++)
+    if (pthread_create(&pf->tv[pf->nt], NULL, _ftprefetch_thread, pf) != 0)
       break;
+
+  if (pf->nt == 0) {
+    _ftprefetch_free(pf);
+    return NULL;
   }
 
- End:
-  if (dp)
-    vfs_closedir(dp);
-  _ftcb_destroy(&ftcb);
+  return pf;
+}
+
+/*
+ * Start prefetching for a new batch of directory entries. Returns -1
+ * (and does nothing) if the directory path could not be saved.
+ */
+static int
+_ftprefetch_start(FTPREFETCH *pf,
+		  VFS_DIRENT *dv,
+		  size_t n,
+		  int fd,
+		  const char *dir,
+		  size_t dlen) {
+  size_t i;
+
+
+  /* The walking thread keeps changing its path buffer, so use a copy */
+  if (dlen+1 > pf->dsize) {
+    char *nb = realloc(pf->dir, dlen+1);
+
+    if (!nb)
+      return -1;
+    pf->dir = nb;
+    pf->dsize = dlen+1;
+  }
+  memcpy(pf->dir, dir, dlen);
+  pf->dir[dlen] = '\0';
+
+  pthread_mutex_lock(&pf->mtx);
+  pf->dv = dv;
+  pf->n = n;
+  pf->fd = fd;
+  for (i = 0; i < n; i++)
+    pf->v[i].state = FTPF_QUEUED;
+  pf->next = 0;
+  pf->limit = (n < pf->window ? n : pf->window);
+  pthread_cond_broadcast(&pf->work);
+  pthread_mutex_unlock(&pf->mtx);
+  return 0;
+}
+
+/* The walking thread has reached entry 'i', allow helpers to go further */
+static void
+_ftprefetch_advance(FTPREFETCH *pf,
+		    size_t i) {
+  size_t limit = i+pf->window;
+
+
+  if (limit > pf->n)
+    limit = pf->n;
+
+  pthread_mutex_lock(&pf->mtx);
+  if (limit > pf->limit) {
+    pf->limit = limit;
+    pthread_cond_broadcast(&pf->work);
+  }
+  pthread_mutex_unlock(&pf->mtx);
+}
+
+/*
+ * Get the prefetched data for entry 'i'. Returns -1 if there is none
+ * and the caller has to do it itself.
+ */
+static int
+_ftprefetch_get(FTPREFETCH *pf,
+		size_t i,
+		struct stat *sp,
+		GACL **app) {
+  FTPFENT *ep = &pf->v[i];
+  int rc = -1;
+
+
+  pthread_mutex_lock(&pf->mtx);
+  if (ep->state == FTPF_QUEUED) {
+    /* Not started yet, let the helpers skip it */
+    if (pf->next <= i)
+      pf->next = i+1;
+  } else {
+    while (ep->state != FTPF_DONE)
+      pthread_cond_wait(&pf->done, &pf->mtx);
+    if (ep->rc == 0) {
+      *sp = ep->sb;
+      *app = ep->acl;
+      ep->acl = NULL;
+      rc = 0;
+    }
+  }
+  pthread_mutex_unlock(&pf->mtx);
   return rc;
 }
 
-int
-ft_foreach(const char *path,
-	   int (*walker)(const char *path,
-			 const struct stat *stat,
-			 size_t base,
-			 size_t level,
-			 void *vp),
-	   void *vp,
-	   size_t maxlevel,
-	   mode_t filetypes) {
-  struct stat stat;
+/* Stop prefetching for the current batch and drop unused results */
+static void
+_ftprefetch_end(FTPREFETCH *pf) {
+  size_t i;
+
+
+  pthread_mutex_lock(&pf->mtx);
+  pf->limit = pf->next;
+  while (pf->busy > 0)
+    pthread_cond_wait(&pf->done, &pf->mtx);
+  for (i = 0; i < pf->next; i++)
+    if (pf->v[i].state == FTPF_DONE && pf->v[i].acl) {
+      gacl_free(pf->v[i].acl);
+      pf->v[i].acl = NULL;
+    }
+  pf->n = pf->next = pf->limit = 0;
+  pthread_mutex_unlock(&pf->mtx);
+}
 
+#else
 
-  if (vfs_lstat(path, &stat) < 0)
+typedef struct ftprefetch FTPREFETCH;
+
+#define _ftprefetch_new(nt, filetypes)   NULL
+#define _ftprefetch_free(pf)
+#define _ftprefetch_start(pf, dv, n, fd, dir, dlen) (-1)
+#define _ftprefetch_advance(pf, i)
+#define _ftprefetch_get(pf, i, sp, app)  (-1)
+#define _ftprefetch_end(pf)
+
+#endif
+
+
+typedef struct ftwalk {
+  int (*walker)(const char *path,
+		const struct stat *stat,
+		size_t base,
+		size_t level,
+		void *vp);
+  void *vp;
+  size_t maxlevel;
+  mode_t filetypes;
+  int f_inodeorder;
+  int f_mounts;		/* Check for other filesystems */
+  dev_t dev;		/* Device of the root */
+  FTPREFETCH *pf;
+  VFS_IO *io;		/* Batched lookups (--io-uring) */
+  VFS_META *mv;
+  FTPATH path;
+  size_t mem;		/* Bytes used by queued names */
+  size_t memlimit;
+} FTWALK;
+
+
+/*
+ * Names of the subdirectories of one directory that are waiting to be
+ * descended into, packed NUL-separated in a single buffer. When the walk
+ * would go above its memory limit the rest of the names are written to
+ * a temporary file instead, so memory use does not grow with fan-out.
+ */
+typedef struct ftnames {
+  char *buf;
+  size_t len;
+  size_t size;
+  size_t pos;
+  FILE *spill;
+  char *lbuf;
+  size_t lsize;
+} FTNAMES;
+
+static int
+_ftnames_add(FTWALK *fw,
+	     FTNAMES *np,
+	     const char *name) {
+  size_t nlen = strlen(name)+1;
+
+
+  if (!np->spill && np->len+nlen > np->size) {
+    size_t ns = np->size ? np->size : 1024;
+
+    while (np->len+nlen > ns)
+      ns *= 2;
+
+    if (fw->memlimit && fw->mem+(ns-np->size) > fw->memlimit) {
+      np->spill = tmpfile();
+      if (!np->spill)
+	return -1;
+    } else {
+      char *nb = realloc(np->buf, ns);
+
+      if (!nb)
+	return -1;
+      fw->mem += ns-np->size;
+      np->buf = nb;
+      np->size = ns;
+    }
+  }
+
+  if (np->spill)
+    return fwrite(name, 1, nlen, np->spill) == nlen ? 0 : -1;
+
+  memcpy(np->buf+np->len, name, nlen);
+  np->len += nlen;
+  return 0;
+}
+
+/*
+ * Get the next queued name. Returns 1 and the name, 0 at the end of the
+ * list or -1 on errors (so a failing spill file does not end the list).
+ */
+static int
+_ftnames_next(FTNAMES *np,
+	      const char **namep) {
+  size_t i;
+  int c;
+
+
+  if (np->pos < np->len) {
+    *namep = np->buf+np->pos;
+    np->pos += strlen(*namep)+1;
+    return 1;
+  }
+
+  if (!np->spill)
+    return 0;
+
+  if (np->pos == np->len) {
+    rewind(np->spill);
+    np->pos++;
+  }
+
+  i = 0;
+  while ((c = getc(np->spill)) != EOF) {
+    if (i+1 >= np->lsize) {
+      size_t ns = np->lsize ? np->lsize*2 : 256;
+      char *nb = realloc(np->lbuf, ns);
+
+      if (!nb)
+	return -1;
+      np->lbuf = nb;
+      np->lsize = ns;
+    }
+    np->lbuf[i++] = c;
+    if (c == '\0') {
+      *namep = np->lbuf;
+      return 1;
+    }
+  }
+
+  if (ferror(np->spill))
+    return -1;
+  if (i > 0) {
+    /* Truncated name */
+    errno = EIO;
     return -1;
+  }
+  return 0;
+}
+
+static void
+_ftnames_free(FTWALK *fw,
+	      FTNAMES *np) {
+  fw->mem -= np->size;
+  free(np->buf);
+  free(np->lbuf);
+  if (np->spill)
+    fclose(np->spill);
+}
+
+
+static int
+_ftnames_find(FTNAMES *np,
+	      const char *name) {
+  size_t pos, i;
+  int c, f_match;
+
+
+  for (pos = 0; pos < np->len; pos += strlen(np->buf+pos)+1)
+    if (strcmp(np->buf+pos, name) == 0)
+      return 1;
+
+  if (!np->spill)
+    return 0;
+
+  rewind(np->spill);
+  i = 0;
+  f_match = 1;
+  while ((c = getc(np->spill)) != EOF) {
+    if (f_match && name[i] == c) {
+      if (c == '\0')
+	return 1;
+      i++;
+    } else if (c == '\0') {
+      i = 0;
+      f_match = 1;
+    } else
+      f_match = 0;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Checkpointing of serial tree walks. The argument index and the path
+ * of the last object the walker has completed is saved (atomically, via
+ * a temporary file) every FT_CHECKPOINT_INTERVAL seconds. When resuming,
+ * the walk is restarted from the top but everything up to and including
+ * the saved object is skipped without calling the walker. This relies on
+ * the traversal order being the same as in the interrupted run.
+ */
+static struct {
+  char *file;
+  char *tmp;
+  time_t saved;
+  int index;
+  int r_index;
+  char *r_path;
+  int f_failed;		/* Saving failed, stop trying */
+} ft_cp = { NULL, NULL, 0, 0, -1, NULL, 0 };
+
+static void
+_ft_checkpoint_save(const char *path) {
+  FILE *fp;
+  time_t now;
+
+
+  if (!ft_cp.file || ft_cp.f_failed)
+    return;
+
+  time(&now);
+  if (now < ft_cp.saved+FT_CHECKPOINT_INTERVAL)
+    return;
+  ft_cp.saved = now;
+
+  fp = fopen(ft_cp.tmp, "w");
+  if (!fp)
+    goto Fail;
+  fprintf(fp, "%d\n", ft_cp.index);
+  fwrite(path, 1, strlen(path)+1, fp);
+  if (ferror(fp)) {
+    fclose(fp);
+    goto Fail;
+  }
+  if (fclose(fp) == 0 && rename(ft_cp.tmp, ft_cp.file) == 0)
+    return;
+
+ Fail:
+  /* Not worth aborting the walk for (like when the disk is full) */
+  fprintf(stderr, "%s: Warning: %s: Saving checkpoint: %s (checkpointing disabled)\n",
+	  argv0, ft_cp.file, strerror(errno));
+  (void) unlink(ft_cp.tmp);
+  ft_cp.f_failed = 1;
+}
+
+static int
+_ft_checkpoint_load(const char *file) {
+  FILE *fp;
+  size_t len, size;
+  int c;
+
+
+  fp = fopen(file, "r");
+  if (!fp)
+    return -1;
+
+  if (fscanf(fp, "%d", &ft_cp.r_index) != 1 || ft_cp.r_index < 0 ||
+      getc(fp) != '\n') {
+    fclose(fp);
+    errno = EINVAL;
+    return -1;
+  }
+
+  len = size = 0;
+  while ((c = getc(fp)) != EOF && c != '\0') {
+    if (len+1 >= size) {
+      char *nb;
+
+      size = size ? size*2 : 256;
+      nb = realloc(ft_cp.r_path, size);
+      if (!nb) {
+	fclose(fp);
+	return -1;
+      }
+      ft_cp.r_path = nb;
+    }
+    ft_cp.r_path[len++] = c;
+  }
+  fclose(fp);
+
+  if (c != '\0' || len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  ft_cp.r_path[len] = '\0';
+  return 0;
+}
+
+/*
+ * Set up checkpointing to 'file' and/or resuming from 'resume'
+ * (either may be NULL). The same file may be used for both.
+ */
+int
+ft_checkpoint_init(const char *file,
+		   const char *resume) {
+  ft_checkpoint_done(1);
+
+  if (resume && _ft_checkpoint_load(resume) < 0)
+    return -1;
+
+  if (file) {
+    ft_cp.file = strdup(file);
+    ft_cp.tmp = malloc(strlen(file)+5);
+    if (!ft_cp.file || !ft_cp.tmp)
+      return -1;
+    sprintf(ft_cp.tmp, "%s.tmp", file);
+    time(&ft_cp.saved);
+  }
+
+  return 0;
+}
+
+/*
+ * Select the argument index about to be walked. Returns 1 if it was
+ * completed in the run being resumed and should be skipped.
+ */
+int
+ft_checkpoint_arg(int index) {
+  ft_cp.index = index;
+
+  return (ft_cp.r_path && index < ft_cp.r_index);
+}
+
+/*
+ * End checkpointing. The checkpoint file is removed if the walk
+ * completed successfully (rc == 0).
+ */
+void
+ft_checkpoint_done(int rc) {
+  if (ft_cp.file && rc == 0)
+    unlink(ft_cp.file);
+
+  free(ft_cp.file);
+  free(ft_cp.tmp);
+  free(ft_cp.r_path);
+  ft_cp.file = NULL;
+  ft_cp.tmp = NULL;
+  ft_cp.r_path = NULL;
+  ft_cp.r_index = -1;
+  ft_cp.f_failed = 0;
+}
+
+
+static int
+_ft_lstat(FTWALK *fw,
+	  int fd,
+	  const char *name,
+	  struct stat *sp) {
+  if (fd >= 0)
+    return vfs_lstatat(fd, name, sp);
+
+  return vfs_lstat(fw->path.buf, sp);
+}
+
+static int
+_ft_match(FTWALK *fw,
+	  FTMATCH *mp,
+	  size_t plen,
+	  const char *name) {
+  if (mp->np && _ftpath_set(&fw->path, plen, name) < 0)
+    return -1;
+
+  return _ftmatch(mp, name, mp->np ? fw->path.buf : NULL);
+}
+
+static int
+_ft_call(FTWALK *fw,
+	 int fd,
+	 const char *name,
+	 const struct stat *sp,
+	 GACL *acl,
+	 size_t level) {
+  int rc;
+
+
+  if (fd >= 0) {
+    vfs_at_set(fw->path.buf, fd, name);
+    if (acl)
+      vfs_at_set_acl(acl, GACL_TYPE_NFS4);
+  }
+  else if (acl)
+    gacl_free(acl);
+  rc = fw->walker(fw->path.buf, sp, 0, level, fw->vp);
+  if (fd >= 0)
+    vfs_at_clear();
+
+  if (rc == 0)
+    _ft_checkpoint_save(fw->path.buf);
+  return rc;
+}
+
+
+/*
+ * Look up the metadata (and ACLs) of a batch of directory entries with
+ * vfs_io_meta(). Returns 0 if the results in fw->mv can be used.
+ */
+static int
+_ftio_start(FTWALK *fw,
+	    VFS_DIRENT *dv,
+	    size_t n,
+	    int fd,
+	    size_t plen) {
+  size_t i;
+
+
+  for (i = 0; i < n; i++) {
+    mode_t ftype = dv[i].d_type;
+
+    /* Same checks as in _ft_foreach_dir() for objects that are not stat'ed */
+    if ((ftype && (S_ISDIR(ftype) || (fw->filetypes && !(ftype & fw->filetypes)))) ||
+	(ft_exclude.size && _ft_match(fw, &ft_exclude, plen, dv[i].d_name) > 0))
+      fw->mv[i].name = NULL;
+    else
+      fw->mv[i].name = dv[i].d_name;
+  }
+  fw->path.buf[plen] = '\0';
+  fw->path.len = plen;
+
+  if (vfs_io_meta(fw->io, fd, fw->mv, n, fw->filetypes, _ftfilter_skip) < 0) {
+    /* Give up on it and use the normal system calls from now on */
+    for (i = 0; i < n; i++)
+      if (fw->mv[i].acl) {
+	gacl_free(fw->mv[i].acl);
+	fw->mv[i].acl = NULL;
+      }
+    vfs_io_free(fw->io);
+    fw->io = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Drop the unused results of the current batch */
+static void
+_ftio_end(FTWALK *fw,
+	  size_t n) {
+  size_t i;
+
+
+  for (i = 0; i < n; i++)
+    if (fw->mv[i].acl) {
+      gacl_free(fw->mv[i].acl);
+      fw->mv[i].acl = NULL;
+    }
+}
+
+
+/*
+ * Walk the entries of an open directory (the walker has already been
+ * called for the directory itself), closing it when done.
+ *
+ * Non-directories are handed to the walker while reading the directory
+ * and subdirectories are then visited in order. If the directory has a
+ * usable fd it is kept open and everything below it is accessed with
+ * fstatat()/openat() relative to it, otherwise full paths are used.
+ * Objects are only stat'ed when they are passed to the walker or when
+ * readdir() does not know if it is a directory.
+ *
+ * When resuming from a checkpoint, 'rv' is the NULL-terminated list of
+ * path components (below this directory) of the last completed object.
+ * Everything before it in the traversal order is skipped.
+ */
+static int
+_ft_foreach_dir(FTWALK *fw,
+		VFS_DIR *dp,
+		size_t curlevel,
+		char **rv) {
+  FTNAMES names;
+  FTBATCH batch;
+  struct stat sb;
+  const char *name;
+  size_t i, plen = fw->path.len;
+  int f_dirs = (!fw->filetypes || (S_IFDIR & fw->filetypes));
+  int f_skip = (rv != NULL);
+  int fd = vfs_dirfd(dp);
+  int n, rc = 0, f_pf = 0, f_io = 0;
+  GACL *acl;
+
+
+  memset(&names, 0, sizeof(names));
+  memset(&batch, 0, sizeof(batch));
+
+  while ((n = _ftbatch_read(&batch, dp, fw->f_inodeorder, fw->path.buf, plen)) > 0) {
+    if (fw->io && fd >= 0 && !f_skip &&
+	_ftio_start(fw, batch.v, n, fd, plen) == 0)
+      f_io = n;
+    else if (fw->pf && fd >= 0 && !f_skip &&
+	     _ftprefetch_start(fw->pf, batch.v, n, fd, fw->path.buf, plen) == 0)
+      f_pf = 1;
+
+    for (i = 0; i < n; i++) {
+      mode_t ftype = batch.v[i].d_type;
+
+      if (f_pf)
+	_ftprefetch_advance(fw->pf, i);
+
+      name = batch.v[i].d_name;
+      if (ft_exclude.size) {
+	int m = _ft_match(fw, &ft_exclude, plen, name);
+
+	if (m < 0) {
+	  rc = -1;
+	  goto End;
+	}
+	if (m)
+	  continue;
+      }
+
+      if (ftype) {
+	if (S_ISDIR(ftype)) {
+	  if (!f_dirs && curlevel == fw->maxlevel)
+	    continue;
+	  if (_ftnames_add(fw, &names, name) < 0) {
+	    rc = -1;
+	    goto End;
+	  }
+	  continue;
+	}
+
+	/* Filtered out, no need to stat it */
+	if (fw->filetypes && !(ftype & fw->filetypes))
+	  continue;
+
+	/* Already done in the run being resumed */
+	if (f_skip) {
+	  if (!rv[1] && strcmp(name, rv[0]) == 0) {
+	    f_skip = 0;
+	    rv = NULL;
+	  }
+	  continue;
+	}
+      }
+
+      acl = NULL;
+      if (_ftpath_set(&fw->path, plen, name) < 0) {
+	rc = -1;
+	goto End;
+      }
+      if (f_io && fw->mv[i].rc == 0) {
+	sb = fw->mv[i].stat;
+	acl = fw->mv[i].acl;
+	fw->mv[i].acl = NULL;
+      }
+      else if ((!f_pf || _ftprefetch_get(fw->pf, i, &sb, &acl) < 0) &&
+	       _ft_lstat(fw, fd, name, &sb) < 0) {
+	rc = -1;
+	goto End;
+      }
+
+      if (S_ISDIR(sb.st_mode)) {
+	if (_ftnames_add(fw, &names, name) < 0) {
+	  rc = -1;
+	  goto End;
+	}
+      }
+      else if (f_skip) {
+	if (!rv[1] && strcmp(name, rv[0]) == 0) {
+	  f_skip = 0;
+	  rv = NULL;
+	}
+      }
+      else if (!fw->filetypes || (sb.st_mode & fw->filetypes)) {
+	ft_weight = (batch.w ? batch.w[i] : 1.0);
+	rc = _ft_call(fw, fd, name, &sb, acl, curlevel);
+	ft_weight = 1.0;
+	acl = NULL;
+	if (rc)
+	  goto End;
+      }
+      if (acl)
+	gacl_free(acl);
+    }
+
+    if (f_pf) {
+      _ftprefetch_end(fw->pf);
+      f_pf = 0;
+    }
+    if (f_io) {
+      _ftio_end(fw, f_io);
+      f_io = 0;
+    }
+  }
+  _ftbatch_free(&batch);
+  if (n < 0) {
+    rc = -1;
+    goto End;
+  }
+
+  /*
+   * Only keep the directory open if we walk relative to it, and only
+   * for the top FT_OPEN_LEVELS levels so deep trees do not run out of
+   * file descriptors. Below that subdirectories are opened by path.
+   */
+  if (fd < 0 || curlevel >= FT_OPEN_LEVELS) {
+    vfs_closedir(dp);
+    dp = NULL;
+    fd = -1;
+  }
+
+  if (rv && !_ftnames_find(&names, rv[0])) {
+    fw->path.buf[plen] = '\0';
+    fprintf(stderr, "%s: Warning: %s/%s: Resume point not found\n",
+	    argv0, fw->path.buf, rv[0]);
+    rv = NULL;
+  }
+
+  while ((n = _ftnames_next(&names, &name)) > 0) {
+    VFS_DIR *sdp;
+    char **srv = NULL;
+
+    if (rv && strcmp(name, rv[0]) != 0)
+      continue;
+
+    if (_ftpath_set(&fw->path, plen, name) < 0) {
+      rc = -1;
+      goto End;
+    }
+
+    if (rv) {
+      /* Walker already called for it, continue below it */
+      srv = (rv[1] ? rv+1 : NULL);
+      rv = NULL;
+    }
+    else if (f_dirs || fw->f_mounts) {
+      if (_ft_lstat(fw, fd, name, &sb) < 0) {
+	rc = -1;
+	goto End;
+      }
+      if (fw->f_mounts && _ft_pruned(fw->dev, fw->path.buf, &sb))
+	continue;
+      if (f_dirs) {
+	rc = _ft_call(fw, fd, name, &sb, NULL, curlevel);
+	if (rc < 0)
+	  goto End;
+	rc = 0;
+      }
+    }
+
+    if (curlevel == fw->maxlevel ||
+	(ft_prune.size && _ftmatch(&ft_prune, name, fw->path.buf)))
+      continue;
+
+    sdp = (fd >= 0 ? vfs_opendirat(dp, name) : vfs_opendir(fw->path.buf));
+    if (!sdp) {
+      rc = -1;
+      goto End;
+    }
+    rc = _ft_foreach_dir(fw, sdp, curlevel+1, srv);
+    if (rc)
+      goto End;
+  }
+  if (n < 0)
+    rc = -1;
+
+ End:
+  if (f_pf)
+    _ftprefetch_end(fw->pf);
+  if (f_io)
+    _ftio_end(fw, f_io);
+  if (dp)
+    vfs_closedir(dp);
+  fw->path.buf[plen] = '\0';
+  fw->path.len = plen;
+  _ftbatch_free(&batch);
+  _ftnames_free(fw, &names);
+  return rc;
+}
+
+
+int
+_ft_foreach(const char *path,
+	    struct stat *stat,
+	    int (*walker)(const char *path,
+			  const struct stat *stat,
+			  size_t base,
+			  size_t level,
+			  void *vp),
+	    void *vp,
+	    size_t curlevel,
+	    size_t maxlevel,
+	    mode_t filetypes) {
+  FTWALK fw;
+  VFS_DIR *dp;
+  char *rbuf = NULL, **rv = NULL;
+  int rc;
+
+  
+  memset(&fw, 0, sizeof(fw));
+  if (ft_cp.r_path && ft_cp.index == ft_cp.r_index) {
+    /* Resume after the last completed object of this argument */
+    size_t plen = strlen(path);
+
+    if (strcmp(ft_cp.r_path, path) == 0)
+      rc = 0;
+    else if (strncmp(ft_cp.r_path, path, plen) == 0 && ft_cp.r_path[plen] == '/') {
+      char *cp;
+      int n = 0;
+
+      rbuf = strdup(ft_cp.r_path+plen);
+      rv = calloc(strlen(rbuf)/2+2, sizeof(char *));
+      if (!rbuf || !rv) {
+	free(rbuf);
+	free(rv);
+	return -1;
+      }
+      for (cp = strtok(rbuf, "/"); cp; cp = strtok(NULL, "/"))
+	rv[n++] = cp;
+      rc = 0;
+    } else {
+      fprintf(stderr, "%s: Warning: %s: Resume point not found\n",
+	      argv0, ft_cp.r_path);
+      rc = 1;
+    }
+    free(ft_cp.r_path);
+    ft_cp.r_path = NULL;
+  }
+
+  /*
+   * Always visit the argument object itself, also when resuming - some
+   * walkers (inherit-access) pick up their state from it
+   */
+  if (!filetypes || (stat->st_mode & filetypes))
+    rc = walker(path, stat, 0, curlevel, vp);
+  else
+    rc = 0;
+  if (rc < 0)
+    goto End;
+  if (rc == 0 && !rv)
+    _ft_checkpoint_save(path);
+
+  rc = 0;
+  if (!S_ISDIR(stat->st_mode) || curlevel == maxlevel)
+    goto End;
+
+  fw.walker = walker;
+  fw.vp = vp;
+  fw.maxlevel = maxlevel;
+  fw.filetypes = filetypes;
+  fw.f_inodeorder = config.f_inodeorder;
+  fw.f_mounts = (config.f_xdev || config.prune_fstypes);
+  fw.dev = stat->st_dev;
+  if (config.f_uring) {
+    fw.io = vfs_io_new();
+    if (fw.io) {
+      fw.mv = calloc(FT_BATCH_MAX, sizeof(fw.mv[0]));
+      if (!fw.mv) {
+	vfs_io_free(fw.io);
+	fw.io = NULL;
+      }
+    } else if (config.f_verbose)
+      fprintf(stderr, "%s: Warning: io_uring not available: %s\n",
+	      argv0, strerror(errno));
+  }
+  if (config.prefetch > 0 && !fw.io)
+    fw.pf = _ftprefetch_new(config.prefetch, filetypes);
+  fw.memlimit = config.max_memory ? config.max_memory : FT_MEMORY_LIMIT;
+
+  fw.path.len = strlen(path);
+  fw.path.size = fw.path.len+256;
+  fw.path.buf = malloc(fw.path.size);
+  if (!fw.path.buf) {
+    rc = -1;
+    goto End;
+  }
+  strcpy(fw.path.buf, path);
+  
+  dp = vfs_opendir(path);
+  if (!dp) {
+    rc = -1;
+    goto End;
+  }
+
+  rc = _ft_foreach_dir(&fw, dp, curlevel+1, (rv && rv[0]) ? rv : NULL);
+
+ End:
+  _ftprefetch_free(fw.pf);
+  vfs_io_free(fw.io);
+  free(fw.mv);
+  free(fw.path.buf);
+  free(rv);
+  free(rbuf);
+  return rc;
+}
+
+
+#if HAVE_PTHREAD_H
+/*
+ * Parallel tree walker.
+ *
+ * Work is distributed at directory granularity. Every worker thread owns a
+ * deque of directories waiting to be scanned. Subdirectories found while
+ * scanning are pushed to the tail of the worker's own deque and popped from
+ * there (depth first), and an idle worker steals from the head of another
+ * worker's deque (which tends to be the largest unexplored subtree).
+ *
+ * The walker callback is called concurrently from the worker threads, so it
+ * must be thread safe and may not depend on the order objects are visited in.
+ */
+
+typedef struct ftjob {
+  char *path;
+  struct stat stat;
+  size_t level;
+} FTJOB;
+
+typedef struct ftdeque {
+  pthread_mutex_t mtx;
+  FTJOB **v;
+  size_t head;
+  size_t c;
+  size_t s;
+} FTDEQUE;
+
+struct ftpool;
+
+typedef struct ftworker {
+  struct ftpool *pool;
+  pthread_t tid;
+  int started;
+  FTDEQUE dq;
+} FTWORKER;
+
+/*
+ * Latency-adaptive concurrency (--min-jobs/--max-jobs). The workers must
+ * take a slot for the metadata operations of each object (lstat and the
+ * walker call doing getxattr/setxattr), and the number of slots is adjusted AIMD-style once per window of
+ * operations: +1 while latency stays close to the best seen so far,
+ * and -25% when the median or 90th percentile grows well beyond it.
+ */
+#define FTAIMD_WINDOW 512	/* Max latency samples per window */
+#define FTAIMD_SLACK  200	/* Latency noise to ignore (microseconds) */
+
+typedef struct ftaimd {
+  pthread_cond_t slot;
+  unsigned int min;
+  unsigned int max;
+  unsigned int limit;	/* Operations allowed in flight */
+  unsigned int active;	/* Operations in flight */
+  unsigned long base;	/* Best median latency seen (us) */
+  unsigned long v[FTAIMD_WINDOW];
+  size_t n;
+} FTAIMD;
+
+/* Last limit used, the next tree walk starts from it */
+static unsigned int ft_aimd_last = 0;
+
+typedef struct ftpool {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  FTAIMD *aimd;
+  size_t queued;	/* Jobs waiting in a deque */
+  size_t pending;	/* Jobs waiting or being processed */
+  size_t mem;		/* Bytes used by queued jobs */
+  size_t memlimit;
+  volatile int rc;	/* First failure, stops the walk */
+  int ec;
+  unsigned int nw;
+  FTWORKER *wv;
+  int (*walker)(const char *path,
+		const struct stat *stat,
+		size_t base,
+		size_t level,
+		void *vp);
+  void *vp;
+  size_t maxlevel;
+  mode_t filetypes;
+  int f_mounts;
+  dev_t dev;
+} FTPOOL;
+
+
+static int
+_ftdeque_push(FTDEQUE *dq,
+	      FTJOB *jp) {
+  pthread_mutex_lock(&dq->mtx);
+  if (dq->c >= dq->s) {
+    size_t i, ns = dq->s ? dq->s*2 : 64;
+    FTJOB **nv = malloc(ns * sizeof(*nv));
+
+    if (!nv) {
+      pthread_mutex_unlock(&dq->mtx);
+      return -1;
+    }
+    for (i = 0; i < dq->c; i++)
+      nv[i] = dq->v[(dq->head + i) % dq->s];
+    free(dq->v);
+    dq->v = nv;
+    dq->s = ns;
+    dq->head = 0;
+  }
+  dq->v[(dq->head + dq->c) % dq->s] = jp;
+  dq->c++;
+  pthread_mutex_unlock(&dq->mtx);
+  return 0;
+}
+
+/* Owner end - newest first */
+static FTJOB *
+_ftdeque_pop(FTDEQUE *dq) {
+  FTJOB *jp = NULL;
+
+  pthread_mutex_lock(&dq->mtx);
+  if (dq->c > 0) {
+    --dq->c;
+    jp = dq->v[(dq->head + dq->c) % dq->s];
+  }
+  pthread_mutex_unlock(&dq->mtx);
+  return jp;
+}
+
+/* Thief end - oldest first */
+static FTJOB *
+_ftdeque_steal(FTDEQUE *dq) {
+  FTJOB *jp = NULL;
+
+  pthread_mutex_lock(&dq->mtx);
+  if (dq->c > 0) {
+    jp = dq->v[dq->head];
+    dq->head = (dq->head + 1) % dq->s;
+    --dq->c;
+  }
+  pthread_mutex_unlock(&dq->mtx);
+  return jp;
+}
+
+
+static int
+_ftaimd_cmp(const void *a,
+	    const void *b) {
+  unsigned long x = * (const unsigned long *) a;
+  unsigned long y = * (const unsigned long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* End of a window of samples, adjust the limit. Called locked. */
+static void
+_ftaimd_adjust(FTAIMD *ap) {
+  unsigned long p50, p90;
+  unsigned int limit = ap->limit;
+
+
+  qsort(ap->v, ap->n, sizeof(ap->v[0]), _ftaimd_cmp);
+  p50 = ap->v[ap->n/2];
+  p90 = ap->v[(ap->n*9)/10];
+  ap->n = 0;
+
+  /* Slowly forget the best, in case the server has become slower for good */
+  if (!ap->base || p50 < ap->base)
+    ap->base = p50;
+  else
+    ap->base += ap->base/32 + 1;
+
+  if (p50 > 2*ap->base + FTAIMD_SLACK || p90 > 4*ap->base + 2*FTAIMD_SLACK)
+    limit -= limit/4;
+  else
+    limit++;
+
+  if (limit < ap->min)
+    limit = ap->min;
+  if (limit > ap->max)
+    limit = ap->max;
+
+  if (config.f_debug && limit != ap->limit)
+    fprintf(stderr, "*** ft_foreach: Concurrency %u -> %u (p50 %luus, p90 %luus, base %luus)\n",
+	    ap->limit, limit, p50, p90, ap->base);
+
+  if (limit > ap->limit)
+    pthread_cond_broadcast(&ap->slot);
+  ap->limit = limit;
+}
+
+/* Throttle delays of this thread when its current operation started */
+static __thread long ft_op_slept = 0;
+
+/* Wait for a free slot for a metadata operation */
+static void
+_ftpool_enter(FTPOOL *pp,
+	      struct timespec *tp) {
+  FTAIMD *ap = pp->aimd;
+
+
+  if (!ap)
+    return;
+
+  pthread_mutex_lock(&pp->mtx);
+  while (ap->active >= ap->limit)
+    pthread_cond_wait(&ap->slot, &pp->mtx);
+  ap->active++;
+  pthread_mutex_unlock(&pp->mtx);
+
+  ft_op_slept = vfs_throttle_slept();
+  clock_gettime(CLOCK_MONOTONIC, tp);
+}
+
+static void
+_ftpool_leave(FTPOOL *pp,
+	      const struct timespec *tp) {
+  FTAIMD *ap = pp->aimd;
+  struct timespec now;
+  long us;
+
+
+  if (!ap)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  us = (now.tv_sec - tp->tv_sec)*1000000L + (now.tv_nsec - tp->tv_nsec)/1000;
+
+  /* Waiting for --max-ops-per-sec is not filesystem latency */
+  us -= vfs_throttle_slept() - ft_op_slept;
+
+  pthread_mutex_lock(&pp->mtx);
+  ap->active--;
+  ap->v[ap->n++] = (us > 0 ? us : 0);
+  if (ap->n >= FTAIMD_WINDOW || ap->n >= 8*ap->limit+32)
+    _ftaimd_adjust(ap);
+  pthread_cond_signal(&ap->slot);
+  pthread_mutex_unlock(&pp->mtx);
+}
+
+
+static void
+_ftpool_fail(FTPOOL *pp,
+	     int rc,
+	     int ec) {
+  pthread_mutex_lock(&pp->mtx);
+  if (!pp->rc) {
+    pp->rc = rc;
+    pp->ec = ec;
+  }
+  pthread_mutex_unlock(&pp->mtx);
+}
+
+static int
+_ftpool_add(FTWORKER *wp,
+	    char *path,
+	    const struct stat *sp,
+	    size_t level) {
+  FTPOOL *pp = wp->pool;
+  FTJOB *jp;
+  size_t size = sizeof(*jp)+strlen(path)+1;
+
+
+  /* Over the memory limit the caller has to descend into it directly */
+  pthread_mutex_lock(&pp->mtx);
+  if (pp->memlimit && pp->mem+size > pp->memlimit && pp->pending > 0) {
+    pthread_mutex_unlock(&pp->mtx);
+    return 1;
+  }
+  pp->mem += size;
+  pthread_mutex_unlock(&pp->mtx);
+
+  if (NEW(jp) == NULL) {
+    pthread_mutex_lock(&pp->mtx);
+    pp->mem -= size;
+    pthread_mutex_unlock(&pp->mtx);
+    return -1;
+  }
+
+  jp->path = path;
+  jp->stat = *sp;
+  jp->level = level;
+
+  pthread_mutex_lock(&pp->mtx);
+  pp->queued++;
+  pp->pending++;
+  pthread_mutex_unlock(&pp->mtx);
+
+  if (_ftdeque_push(&wp->dq, jp) < 0) {
+    pthread_mutex_lock(&pp->mtx);
+    pp->queued--;
+    pp->pending--;
+    pp->mem -= size;
+    pthread_mutex_unlock(&pp->mtx);
+    free(jp);
+    return -1;
+  }
+
+  pthread_cond_signal(&pp->cv);
+  return 0;
+}
+
+static FTJOB *
+_ftpool_get(FTWORKER *wp) {
+  FTPOOL *pp = wp->pool;
+  FTJOB *jp;
+  unsigned int i, j;
+
+
+  jp = _ftdeque_pop(&wp->dq);
+  for (i = 1; !jp && i < pp->nw; i++) {
+    j = ((wp - pp->wv) + i) % pp->nw;
+    jp = _ftdeque_steal(&pp->wv[j].dq);
+  }
+  if (jp) {
+    pthread_mutex_lock(&pp->mtx);
+    pp->queued--;
+    pthread_mutex_unlock(&pp->mtx);
+  }
+  return jp;
+}
+
+
+/* Call the walker, catching errors raised on this thread */
+static int
+_ftpool_call(FTPOOL *pp,
+	     const char *path,
+	     const struct stat *sp,
+	     size_t level) {
+  jmp_buf saved_error_env;
+  int rc;
+
+
+  if (pp->filetypes && !(sp->st_mode & pp->filetypes))
+    return 0;
+
+  if ((rc = error_catch(saved_error_env)) != 0) {
+    /* error() aborts the whole walk, just like in the serial case */
+    _ftpool_fail(pp, rc, errno);
+    error_return(rc, saved_error_env);
+  }
+
+  rc = pp->walker(path, sp, 0, level, pp->vp);
+  error_return(rc, saved_error_env);
+}
+
+static int
+_ftpool_scan(FTWORKER *wp,
+	     FTJOB *jp) {
+  FTPOOL *pp = wp->pool;
+  DIR *dp;
+  FTBATCH batch;
+  struct stat sb;
+  struct timespec t0;
+  size_t level;
+  double weight;
+  int i, n, fd, rc;
+
+
+  _ftpool_enter(pp, &t0);
+  rc = _ftpool_call(pp, jp->path, &jp->stat, jp->level);
+  _ftpool_leave(pp, &t0);
+  if (rc < 0)
+    return rc;
+
+  if (!S_ISDIR(jp->stat.st_mode) || jp->level == pp->maxlevel)
+    return 0;
+
+  level = jp->level+1;
+
+  dp = vfs_opendir(jp->path);
+  if (!dp)
+    return -1;
+  fd = vfs_dirfd(dp);
+
+  memset(&batch, 0, sizeof(batch));
+  rc = 0;
+  i = n = 0;
+  while (!pp->rc) {
+    const char *name;
+    char *fpath;
+    mode_t ftype;
+
+    if (i >= n) {
+      n = _ftbatch_read(&batch, dp, config.f_inodeorder, jp->path, strlen(jp->path));
+      if (n <= 0) {
+	if (n < 0)
+	  rc = -1;
+	break;
+      }
+      i = 0;
+    }
+    name = batch.v[i].d_name;
+    ftype = batch.v[i].d_type;
+    weight = (batch.w ? batch.w[i] : 1.0);
+    i++;
+
+    /* Skip the stat for objects the walker will not see (see _ft_foreach_dir) */
+    if (ftype && pp->filetypes && !(ftype & pp->filetypes) &&
+	(!S_ISDIR(ftype) || level == pp->maxlevel))
+      continue;
+
+    fpath = s_dupcat(jp->path, "/", name, NULL);
+    if (!fpath) {
+      rc = -1;
+      break;
+    }
+
+    if (ft_exclude.size && _ftmatch(&ft_exclude, name, fpath)) {
+      free(fpath);
+      continue;
+    }
+
+    /* One operation slot for the lstat and walker call of an object */
+    _ftpool_enter(pp, &t0);
+    if (ftype && pp->filetypes && !(ftype & pp->filetypes) &&
+	!(pp->f_mounts && S_ISDIR(ftype))) {
+      memset(&sb, 0, sizeof(sb));
+      sb.st_mode = ftype;
+    }
+    else if ((fd >= 0 ? vfs_lstatat(fd, name, &sb) : vfs_lstat(fpath, &sb)) < 0) {
+      _ftpool_leave(pp, &t0);
+      free(fpath);
+      rc = -1;
+      break;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+      if (pp->f_mounts && _ft_pruned(pp->dev, fpath, &sb)) {
+	_ftpool_leave(pp, &t0);
+	free(fpath);
+	continue;
+      }
+      if (ft_prune.size && _ftmatch(&ft_prune, name, fpath)) {
+	rc = _ftpool_call(pp, fpath, &sb, level);
+	_ftpool_leave(pp, &t0);
+	free(fpath);
+	if (rc < 0)
+	  break;
+	rc = 0;
+	continue;
+      }
+      _ftpool_leave(pp, &t0);
+      rc = _ftpool_add(wp, fpath, &sb, level);
+      if (rc > 0) {
+	FTJOB job;
+
+	job.path = fpath;
+	job.stat = sb;
+	job.level = level;
+	rc = _ftpool_scan(wp, &job);
+	free(fpath);
+      }
+      else if (rc < 0)
+	free(fpath);
+      if (rc)
+	break;
+    }
+    else {
+      if (fd >= 0)
+	vfs_at_set(fpath, fd, name);
+      ft_weight = weight;
+      rc = _ftpool_call(pp, fpath, &sb, level);
+      ft_weight = 1.0;
+      vfs_at_clear();
+      _ftpool_leave(pp, &t0);
+      free(fpath);
+      if (rc)
+	break;
+    }
+  }
+
+  vfs_closedir(dp);
+  _ftbatch_free(&batch);
+  return rc;
+}
+
+static void *
+_ftpool_worker(void *vp) {
+  FTWORKER *wp = (FTWORKER *) vp;
+  FTPOOL *pp = wp->pool;
+  FTJOB *jp;
+  size_t size;
+  int rc, done;
+
+
+  for (;;) {
+    jp = _ftpool_get(wp);
+    if (jp) {
+      /* After a failure remaining jobs are just drained */
+      if (!pp->rc) {
+	rc = _ftpool_scan(wp, jp);
+	if (rc)
+	  _ftpool_fail(pp, rc, errno);
+      }
+      size = sizeof(*jp)+strlen(jp->path)+1;
+      free(jp->path);
+      free(jp);
+
+      pthread_mutex_lock(&pp->mtx);
+      pp->mem -= size;
+      if (--pp->pending == 0)
+	pthread_cond_broadcast(&pp->cv);
+      pthread_mutex_unlock(&pp->mtx);
+      continue;
+    }
+
+    pthread_mutex_lock(&pp->mtx);
+    while (pp->pending > 0 && pp->queued == 0)
+      pthread_cond_wait(&pp->cv, &pp->mtx);
+    done = (pp->pending == 0);
+    pthread_mutex_unlock(&pp->mtx);
+    if (done)
+      break;
+  }
+
+  return NULL;
+}
+
+
+static int
+_ft_foreach_parallel(const char *path,
+		     struct stat *stat,
+		     int (*walker)(const char *path,
+				   const struct stat *stat,
+				   size_t base,
+				   size_t level,
+				   void *vp),
+		     void *vp,
+		     size_t maxlevel,
+		     mode_t filetypes,
+		     unsigned int nw,
+		     FTAIMD *ap) {
+  FTPOOL pool;
+  char *rpath;
+  unsigned int i;
+  int rc;
+
+
+  memset(&pool, 0, sizeof(pool));
+  pool.aimd = ap;
+  pool.walker = walker;
+  pool.vp = vp;
+  pool.maxlevel = maxlevel;
+  pool.filetypes = filetypes;
+  pool.f_mounts = (config.f_xdev || config.prune_fstypes);
+  pool.dev = stat->st_dev;
+  pool.memlimit = config.max_memory ? config.max_memory : FT_MEMORY_LIMIT;
+  pool.nw = nw;
+  pool.wv = calloc(nw, sizeof(FTWORKER));
+  if (!pool.wv)
+    return -1;
+
+  pthread_mutex_init(&pool.mtx, NULL);
+  pthread_cond_init(&pool.cv, NULL);
+  if (ap)
+    pthread_cond_init(&ap->slot, NULL);
+  for (i = 0; i < nw; i++) {
+    pool.wv[i].pool = &pool;
+    pthread_mutex_init(&pool.wv[i].dq.mtx, NULL);
+  }
+
+  rpath = s_dup(path);
+  if (!rpath || _ftpool_add(&pool.wv[0], rpath, stat, 0) < 0) {
+    free(rpath);
+    rc = -1;
+    goto End;
+  }
+
+  /* The calling thread acts as worker 0 */
+  for (i = 1; i < nw; i++)
+    pool.wv[i].started = (pthread_create(&pool.wv[i].tid, NULL, _ftpool_worker, &pool.wv[i]) == 0);
+  _ftpool_worker(&pool.wv[0]);
+  for (i = 1; i < nw; i++)
+    if (pool.wv[i].started)
+      pthread_join(pool.wv[i].tid, NULL);
+
+  rc = pool.rc;
+  if (rc)
+    errno = pool.ec;
+
+ End:
+  for (i = 0; i < nw; i++) {
+    free(pool.wv[i].dq.v);
+    pthread_mutex_destroy(&pool.wv[i].dq.mtx);
+  }
+  free(pool.wv);
+  if (ap) {
+    ft_aimd_last = ap->limit;
+    pthread_cond_destroy(&ap->slot);
+  }
+  pthread_cond_destroy(&pool.cv);
+  pthread_mutex_destroy(&pool.mtx);
+  return rc;
+}
+
+/* Run the parallel walker with the number of operations in flight
+   adjusted between min and max */
+static int
+_ft_foreach_adaptive(const char *path,
+		     struct stat *stat,
+		     int (*walker)(const char *path,
+				   const struct stat *stat,
+				   size_t base,
+				   size_t level,
+				   void *vp),
+		     void *vp,
+		     size_t maxlevel,
+		     mode_t filetypes,
+		     unsigned int min,
+		     unsigned int max) {
+  FTAIMD *ap;
+  int rc;
+
+
+  ap = calloc(1, sizeof(*ap));
+  if (!ap)
+    return -1;
+
+  if (min < 1)
+    min = 1;
+  if (max < min)
+    max = min;
+  ap->min = min;
+  ap->max = max;
+  ap->limit = ft_aimd_last ? ft_aimd_last : (config.jobs > 1 ? config.jobs : min);
+  if (ap->limit < min)
+    ap->limit = min;
+  if (ap->limit > max)
+    ap->limit = max;
+
+  rc = _ft_foreach_parallel(path, stat, walker, vp, maxlevel, filetypes, max, ap);
+  free(ap);
+  return rc;
+}
+#endif
+
+
+/*
+ * Hard link deduplication. Non-directories with more than one link are
+ * recorded by (st_dev, st_ino) in an open addressed hash set and only
+ * the first link seen is passed on to the walker.
+ */
+typedef struct ftlink {
+  dev_t dev;
+  ino_t ino;		/* 0 = free slot */
+} FTLINK;
+
+static struct {
+  FTLINK *v;
+  size_t size;		/* Power of 2 */
+  size_t n;
+  size_t skipped;
+#if HAVE_PTHREAD_H
+  pthread_mutex_t mtx;
+#endif
+} ft_links = {
+  NULL, 0, 0, 0,
+#if HAVE_PTHREAD_H
+  PTHREAD_MUTEX_INITIALIZER
+#endif
+};
+
+static size_t
+_ftlink_hash(dev_t dev,
+	     ino_t ino) {
+  unsigned long long h = ((unsigned long long) ino ^ ((unsigned long long) dev << 32));
+
+  h *= 0x9E3779B97F4A7C15ULL;
+  return (size_t) (h ^ (h >> 29));
+}
+
+/* Returns 1 if already present, 0 if added and -1 on failure */
+static int
+_ftlink_add(dev_t dev,
+	    ino_t ino) {
+  size_t i;
+
+
+  if ((ft_links.n+1)*2 > ft_links.size) {
+    size_t j, ns = ft_links.size ? ft_links.size*2 : 1024;
+    FTLINK *nv = calloc(ns, sizeof(FTLINK));
+
+    if (!nv)
+      return -1;
+    for (j = 0; j < ft_links.size; j++) {
+      if (!ft_links.v[j].ino)
+	continue;
+      i = _ftlink_hash(ft_links.v[j].dev, ft_links.v[j].ino) & (ns-1);
+      while (nv[i].ino)
+	i = (i+1) & (ns-1);
+      nv[i] = ft_links.v[j];
+    }
+    free(ft_links.v);
+    ft_links.v = nv;
+    ft_links.size = ns;
+  }
+
+  i = _ftlink_hash(dev, ino) & (ft_links.size-1);
+  while (ft_links.v[i].ino) {
+    if (ft_links.v[i].ino == ino && ft_links.v[i].dev == dev)
+      return 1;
+    i = (i+1) & (ft_links.size-1);
+  }
+  ft_links.v[i].dev = dev;
+  ft_links.v[i].ino = ino;
+  ft_links.n++;
+  return 0;
+}
+
+/* Returns 1 if the object is another link to an inode already seen */
+static int
+_ftlink_seen(const struct stat *sp) {
+  int rc;
+
+
+  if (S_ISDIR(sp->st_mode) || sp->st_nlink < 2 || !sp->st_ino)
+    return 0;
+
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&ft_links.mtx);
+#endif
+  rc = _ftlink_add(sp->st_dev, sp->st_ino);
+  if (rc > 0)
+    ft_links.skipped++;
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&ft_links.mtx);
+#endif
+  return rc;
+}
+
+/* Returns 1 if the object is another link to an inode already seen, without recording it */
+static int
+_ftlink_known(const struct stat *sp) {
+  size_t i;
+  int rc = 0;
+
+
+  if (S_ISDIR(sp->st_mode) || sp->st_nlink < 2 || !sp->st_ino)
+    return 0;
+
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&ft_links.mtx);
+#endif
+  if (ft_links.size) {
+    i = _ftlink_hash(sp->st_dev, sp->st_ino) & (ft_links.size-1);
+    while (ft_links.v[i].ino) {
+      if (ft_links.v[i].ino == sp->st_ino && ft_links.v[i].dev == sp->st_dev) {
+	rc = 1;
+	break;
+      }
+      i = (i+1) & (ft_links.size-1);
+    }
+  }
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&ft_links.mtx);
+#endif
+  return rc;
+}
+
+/*
+ * Forget all recorded hard links. Returns the number of links skipped.
+ */
+size_t
+ft_links_done(void) {
+  size_t n = ft_links.skipped;
+
+
+  free(ft_links.v);
+  ft_links.v = NULL;
+  ft_links.size = ft_links.n = ft_links.skipped = 0;
+  return n;
+}
+
+
+/*
+ * Objects with a st_ctime older than this are not passed to the walker
+ * (0 = disabled). Directories are still descended into.
+ */
+static time_t ft_since = 0;
+
+void
+ft_changed_since(time_t t) {
+  ft_since = t;
+}
+
+
+/*
+ * Walker wrapper for the filters that need the stat data of an object
+ * (--changed-since and --dedup-links).
+ */
+typedef struct ftfilter {
+  int (*walker)(const char *path,
+		const struct stat *stat,
+		size_t base,
+		size_t level,
+		void *vp);
+  void *vp;
+} FTFILTER;
+
+static int
+_ftfilter_walker(const char *path,
+		 const struct stat *sp,
+		 size_t base,
+		 size_t level,
+		 void *vp) {
+  FTFILTER *fp = (FTFILTER *) vp;
+  int rc;
+
+
+  /* Never drop the argument objects, some walkers depend on seeing them */
+  if (level > 0 && ft_since && sp->st_ctime < ft_since)
+    return 0;
+
+  if (config.f_dedup) {
+    rc = _ftlink_seen(sp);
+    if (rc)
+      return rc < 0 ? -1 : 0;
+  }
+
+  return fp->walker(path, sp, base, level, fp->vp);
+}
+
+/*
+ * Returns 1 if _ftfilter_walker() is certain to drop the object, so
+ * there is no point in reading its ACL ahead of time.
+ */
+static int
+_ftfilter_skip(const struct stat *sp) {
+  if (ft_since && sp->st_ctime < ft_since)
+    return 1;
+
+  return (config.f_dedup && _ftlink_known(sp));
+}
+
+
+/*
+ * Disarm all per-command tree walk settings (checkpoints, hard links,
+ * --changed-since, sampling and rate limits). Commands that abort
+ * with error() never get to do this themselves.
+ */
+void
+ft_reset(void) {
+  ft_checkpoint_done(1);
+  (void) ft_links_done();
+  ft_changed_since(0);
+  ft_sample_set(0, 0, 0);
+  vfs_rate_limit(0, 0);
+}
+
+
+int
+ft_foreach(const char *path,
+	   int (*walker)(const char *path,
+			 const struct stat *stat,
+			 size_t base,
+			 size_t level,
+			 void *vp),
+	   void *vp,
+	   size_t maxlevel,
+	   mode_t filetypes) {
+  struct stat stat;
+  FTFILTER ff;
+
+
+  if (vfs_lstat(path, &stat) < 0)
+    return -1;
+
+  if ((ft_exclude.src != config.exclude &&
+       _ftmatch_compile(&ft_exclude, config.exclude) < 0) ||
+      (ft_prune.src != config.prune &&
+       _ftmatch_compile(&ft_prune, config.prune) < 0))
+    return -1;
+
+  if (config.f_dedup || ft_since) {
+    ff.walker = walker;
+    ff.vp = vp;
+    walker = _ftfilter_walker;
+    vp = &ff;
+  }
+
+#if HAVE_PTHREAD_H
+  /* The SMB backend is not thread safe, and checkpoints need a fixed order */
+  if ((config.jobs > 1 || config.max_jobs > 1) && S_ISDIR(stat.st_mode) && maxlevel != 0 &&
+      !ft_cp.file && !ft_cp.r_path &&
+      vfs_get_type(path) == VFS_TYPE_SYS) {
+    if (config.max_jobs > 1)
+      return _ft_foreach_adaptive(path, &stat, walker, vp, maxlevel, filetypes,
+				  config.min_jobs, config.max_jobs);
+    return _ft_foreach_parallel(path, &stat, walker, vp, maxlevel, filetypes, config.jobs, NULL);
+  }
+#endif
 
   return _ft_foreach(path, &stat, walker, vp, 0, maxlevel, filetypes);
 }
@@ -85,6 +85,42 @@ ace2str_icacls(gacl_entry_t ae,
 	       size_t rsize,
 	       const struct stat *sp);
 
+/* Default limit for memory used to queue directories during tree walks */
+#define FT_MEMORY_LIMIT (64*1024*1024)
+
+/* Directory levels kept open during tree walks (to walk relative to them) */
+#define FT_OPEN_LEVELS 128
+
+/* Seconds between saves of tree walk checkpoints */
+#define FT_CHECKPOINT_INTERVAL 5
+
+extern int
+ft_checkpoint_init(const char *file,
+		   const char *resume);
+
+extern int
+ft_checkpoint_arg(int index);
+
+extern void
+ft_checkpoint_done(int rc);
+
+extern size_t
+ft_links_done(void);
+
+extern void
+ft_changed_since(time_t t);
+
+extern void
+ft_sample_set(double rate,
+	      unsigned int per_dir,
+	      unsigned long seed);
+
+extern double
+ft_sample_weight(void);
+
+extern void
+ft_reset(void);
+
 extern int
 ft_foreach(const char *path,
 	   int (*walker)(const char *path,
@@ -262,9 +262,10 @@ opts_parse_argv(int argc,
 	  break;
 
 	case OPTS_TYPE_STR:
+	  /* Optional string values must be attached (-Xvalue) */
 	  if (argv[i][j+1])
 	    value = argv[i]+j+1;
-	  else if (argv[i+1])
+	  else if (argv[i+1] && !(op->type & OPTS_TYPE_OPT))
 	    value = argv[++i];
 
 	  rc = opts_set_value(op, value, argv[0]);
@@ -45,6 +45,7 @@
 #include "vfs.h"
 #include "smb.h"
 #include "strings.h"
+#include "ids.h"
 
 #if HAVE_LIBSMBCLIENT
 #include <libsmbclient.h>
@@ -127,20 +128,20 @@ _smb_init(void) {
 static int
 _smb_name_to_uid(const char *name,
 		 uid_t *uidp) {
-  struct passwd *pp;
   const char *dp;
+  int found;
 
 
-  pp = getpwnam(name);
-  if (!pp) {
+  found = ids_name_to_uid(name, uidp);
+  if (!found) {
     dp = strchr(name, '\\');
     if (dp) {
       /* XXX: Verify that WORKGROUP is "our" */
       name = dp+1;
-      pp = getpwnam(name);
+      found = ids_name_to_uid(name, uidp);
     }
 
-    if (!pp) {
+    if (!found) {
       char *cp, *nbuf;
       int fixflag = 0;
       
@@ -155,23 +156,21 @@ _smb_name_to_uid(const char *name,
 	}
       
       if (fixflag)
-	pp = getpwnam(nbuf);
+	found = ids_name_to_uid(nbuf, uidp);
       
-      if (!pp) {
+      if (!found) {
 	for (cp = nbuf; *cp; cp++)
 	  if (isupper(*cp))
 	    *cp = tolower(*cp);
 	
-	pp = getpwnam(nbuf);
-	if (!pp) {
-	  free(nbuf);
-	  return -1;
-	}
+	found = ids_name_to_uid(nbuf, uidp);
       }
+      free(nbuf);
+      if (!found)
+	return -1;
     }
   }
   
-  *uidp = pp->pw_uid;
   return 0;
 }
 
@@ -179,19 +178,19 @@ _smb_name_to_uid(const char *name,
 static int
 _smb_name_to_gid(const char *name,
 		 gid_t *gidp) {
-  struct group *gp;
   const char *dp;
+  int found;
 
   
-  gp = getgrnam(name);
-  if (!gp) {
+  found = ids_name_to_gid(name, gidp);
+  if (!found) {
     dp = strchr(name, '\\');
     if (dp) {
       /* XXX: Verify that WORKGROUP is "our" */
       name = dp+1;
-      gp = getgrnam(name);
+      found = ids_name_to_gid(name, gidp);
     }
-    if (!gp) {
+    if (!found) {
       char *cp, *nbuf;
       int fixflag = 0;
       
@@ -206,23 +205,21 @@ _smb_name_to_gid(const char *name,
 	}
 
       if (fixflag)
-	gp = getgrnam(nbuf);
+	found = ids_name_to_gid(nbuf, gidp);
       
-      if (!gp) {
+      if (!found) {
 	for (cp = nbuf; *cp; cp++)
 	  if (isupper(*cp))
 	    *cp = tolower(*cp);
 	
-	gp = getgrnam(nbuf);
-	if (!gp) {
-	  free(nbuf);
-	  return -1;
-	}
+	found = ids_name_to_gid(nbuf, gidp);
       }
+      free(nbuf);
+      if (!found)
+	return -1;
     }
   }
 
-  *gidp = gp->gr_gid;
   return 0;
 }
 
@@ -343,6 +340,7 @@ smb_opendir(const char *path) {
 
   vdp->type = VFS_TYPE_SMB;
   vdp->dh.smb = dh;
+  memset(&vdp->batch, 0, sizeof(vdp->batch));
   return vdp;
 }
 
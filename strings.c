@@ -243,7 +243,7 @@ slist_add(SLIST *sp,
 	  char *s) {
 
   if (sp->c >= sp->s) {
-    char **nv = realloc(sp->v, sizeof(char *) * sp->s + 256);
+    char **nv = realloc(sp->v, sizeof(char *) * (sp->s + 256));
     if (!nv)
       return -1;
 
@@ -0,0 +1,474 @@
+/*
+ * uring.c
+ *
+ * Copyright (c) 2019-2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "uring.h"
+
+#if HAVE_LINUX_IO_URING_H && HAVE_DECL___NR_IO_URING_SETUP && HAVE_DECL_IORING_OP_STATX
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENABLED 1
+#endif
+
+
+#if URING_ENABLED
+
+struct uring {
+  int fd;
+  unsigned int features;
+  unsigned int ops;		/* Supported URING_OP_* (bitmask) */
+
+  /* Submission queue */
+  void *sq_ring;
+  size_t sq_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int sq_entries;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned int sq_pending;	/* Prepared but not yet submitted */
+
+  /* Completion queue */
+  void *cq_ring;
+  size_t cq_size;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned int inflight;	/* Submitted but not yet completed */
+};
+
+
+static int
+_uring_setup(unsigned int entries,
+	     struct io_uring_params *pp) {
+  return (int) syscall(__NR_io_uring_setup, entries, pp);
+}
+
+static int
+_uring_enter(int fd,
+	     unsigned int to_submit,
+	     unsigned int min_complete,
+	     unsigned int flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* Find out which of the operations we use the kernel supports */
+static unsigned int
+_uring_probe(int fd) {
+  struct io_uring_probe *pp;
+  unsigned int ops = 0;
+  size_t n = 256;
+
+
+  pp = calloc(1, sizeof(*pp) + n*sizeof(pp->ops[0]));
+  if (!pp)
+    return 0;
+
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, pp, n) < 0) {
+    /* Kernels without probing (< 5.6) do not have statx either */
+    free(pp);
+    return 0;
+  }
+
+  if (IORING_OP_STATX <= pp->last_op &&
+      (pp->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED))
+    ops |= (1<<URING_OP_STATX);
+#if HAVE_DECL_IORING_OP_GETXATTR
+  if (IORING_OP_GETXATTR <= pp->last_op &&
+      (pp->ops[IORING_OP_GETXATTR].flags & IO_URING_OP_SUPPORTED))
+    ops |= (1<<URING_OP_GETXATTR);
+#endif
+
+  free(pp);
+  return ops;
+}
+
+
+void
+uring_free(URING *up) {
+  if (!up)
+    return;
+
+  if (up->sqes && up->sqes != MAP_FAILED)
+    munmap(up->sqes, up->sqes_size);
+  if (up->cq_ring && up->cq_ring != MAP_FAILED && up->cq_ring != up->sq_ring)
+    munmap(up->cq_ring, up->cq_size);
+  if (up->sq_ring && up->sq_ring != MAP_FAILED)
+    munmap(up->sq_ring, up->sq_size);
+  if (up->fd >= 0)
+    close(up->fd);
+  free(up);
+}
+
+
+URING *
+uring_new(unsigned int entries) {
+  struct io_uring_params p;
+  URING *up;
+  char *sq, *cq;
+
+
+  up = calloc(1, sizeof(*up));
+  if (!up)
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  up->fd = _uring_setup(entries, &p);
+  if (up->fd < 0)
+    goto Fail;
+
+  up->features = p.features;
+  up->ops = _uring_probe(up->fd);
+  if (!(up->ops & (1<<URING_OP_STATX))) {
+    errno = ENOSYS;
+    goto Fail;
+  }
+
+  up->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+  up->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && up->cq_size > up->sq_size)
+    up->sq_size = up->cq_size;
+
+  up->sq_ring = mmap(NULL, up->sq_size, PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_POPULATE, up->fd, IORING_OFF_SQ_RING);
+  if (up->sq_ring == MAP_FAILED)
+    goto Fail;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    up->cq_ring = up->sq_ring;
+  else {
+    up->cq_ring = mmap(NULL, up->cq_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, up->fd, IORING_OFF_CQ_RING);
+    if (up->cq_ring == MAP_FAILED)
+      goto Fail;
+  }
+
+  up->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+  up->sqes = mmap(NULL, up->sqes_size, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, up->fd, IORING_OFF_SQES);
+  if (up->sqes == MAP_FAILED)
+    goto Fail;
+
+  sq = (char *) up->sq_ring;
+  up->sq_head    = (unsigned int *) (sq + p.sq_off.head);
+  up->sq_tail    = (unsigned int *) (sq + p.sq_off.tail);
+  up->sq_mask    = (unsigned int *) (sq + p.sq_off.ring_mask);
+  up->sq_array   = (unsigned int *) (sq + p.sq_off.array);
+  up->sq_entries = p.sq_entries;
+
+  cq = (char *) up->cq_ring;
+  up->cq_head = (unsigned int *) (cq + p.cq_off.head);
+  up->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  up->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  up->cqes    = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  return up;
+
+ Fail:
+  if (up->fd < 0 && (errno == EPERM || errno == EINVAL))
+    errno = ENOSYS;
+  uring_free(up);
+  return NULL;
+}
+
+
+int
+uring_supported(URING *up,
+		int op) {
+  return (up && (up->ops & (1<<op)) != 0);
+}
+
+
+/* Number of operations that can be prepared before the next submit */
+unsigned int
+uring_space(URING *up) {
+  return up->sq_entries - up->sq_pending - up->inflight;
+}
+
+
+static struct io_uring_sqe *
+_uring_sqe(URING *up,
+	   unsigned long tag) {
+  struct io_uring_sqe *sqe;
+  unsigned int tail, idx;
+
+
+  if (uring_space(up) == 0) {
+    errno = EBUSY;
+    return NULL;
+  }
+
+  tail = *up->sq_tail + up->sq_pending;
+  idx = tail & *up->sq_mask;
+  sqe = &up->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = tag;
+  up->sq_array[idx] = idx;
+  up->sq_pending++;
+  return sqe;
+}
+
+
+int
+uring_statx(URING *up,
+	    int dirfd,
+	    const char *path,
+	    int flags,
+	    unsigned int mask,
+	    void *stxbuf,
+	    unsigned long tag) {
+  struct io_uring_sqe *sqe = _uring_sqe(up, tag);
+
+
+  if (!sqe)
+    return -1;
+
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = (unsigned long) path;
+  sqe->len = mask;
+  sqe->off = (unsigned long) stxbuf;
+  sqe->statx_flags = flags;
+  return 0;
+}
+
+
+int
+uring_getxattr(URING *up,
+	       const char *path,
+	       const char *name,
+	       void *buf,
+	       size_t size,
+	       unsigned long tag) {
+#if HAVE_DECL_IORING_OP_GETXATTR
+  struct io_uring_sqe *sqe;
+
+
+  if (!uring_supported(up, URING_OP_GETXATTR)) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  sqe = _uring_sqe(up, tag);
+  if (!sqe)
+    return -1;
+
+  sqe->opcode = IORING_OP_GETXATTR;
+  sqe->addr = (unsigned long) name;
+  sqe->addr2 = (unsigned long) buf;
+  sqe->addr3 = (unsigned long) path;
+  sqe->len = size;
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+/*
+ * Submit all prepared operations and wait for at least 'wait'
+ * completions. Returns the number of operations submitted.
+ *
+ * Only operations accepted by the kernel are counted as in flight.
+ * If it fails to accept all of them the rest are dropped and -1 is
+ * returned, the accepted ones must still be reaped (see uring_drain()).
+ */
+int
+uring_submit(URING *up,
+	     unsigned int wait) {
+  unsigned int n = up->sq_pending, left, w;
+  int rc;
+
+
+  /* Make the new entries visible to the kernel */
+  __atomic_store_n(up->sq_tail, *up->sq_tail + n, __ATOMIC_RELEASE);
+  up->sq_pending = 0;
+
+  left = n;
+  do {
+    w = up->inflight + left;
+    if (w > wait)
+      w = wait;
+
+    rc = _uring_enter(up->fd, left, w, w ? IORING_ENTER_GETEVENTS : 0);
+    if (rc > 0) {
+      if (rc > left)
+	rc = left;
+      left -= rc;
+      up->inflight += rc;
+    }
+  } while ((rc < 0 && errno == EINTR) || (rc > 0 && left > 0));
+
+  if (left > 0) {
+    /* Take back the entries the kernel did not consume */
+    __atomic_store_n(up->sq_tail, *up->sq_tail - left, __ATOMIC_RELEASE);
+    if (rc >= 0)
+      errno = EAGAIN;
+    return -1;
+  }
+  if (rc < 0)
+    return -1;
+
+  return n;
+}
+
+
+/*
+ * Wait for all operations in flight to complete and discard their
+ * results, so the buffers they use may be released.
+ */
+int
+uring_drain(URING *up) {
+  unsigned long tag;
+  int res;
+
+
+  up->sq_pending = 0;
+  while (up->inflight > 0) {
+    if (uring_complete(up, &tag, &res))
+      continue;
+
+    if (_uring_enter(up->fd, 0, up->inflight, IORING_ENTER_GETEVENTS) < 0 &&
+	errno != EINTR)
+      return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Reap one completion. Returns 1 and the tag and result (>= 0 or -errno)
+ * of the operation, or 0 if there are no completions waiting.
+ */
+int
+uring_complete(URING *up,
+	       unsigned long *tagp,
+	       int *resp) {
+  unsigned int head = *up->cq_head;
+  struct io_uring_cqe *cqe;
+
+
+  if (head == __atomic_load_n(up->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  cqe = &up->cqes[head & *up->cq_mask];
+  *tagp = (unsigned long) cqe->user_data;
+  *resp = cqe->res;
+  __atomic_store_n(up->cq_head, head+1, __ATOMIC_RELEASE);
+  up->inflight--;
+  return 1;
+}
+
+#else
+
+URING *
+uring_new(unsigned int entries) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+void
+uring_free(URING *up) {
+}
+
+int
+uring_supported(URING *up,
+		int op) {
+  return 0;
+}
+
+unsigned int
+uring_space(URING *up) {
+  return 0;
+}
+
+int
+uring_statx(URING *up,
+	    int dirfd,
+	    const char *path,
+	    int flags,
+	    unsigned int mask,
+	    void *stxbuf,
+	    unsigned long tag) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+uring_getxattr(URING *up,
+	       const char *path,
+	       const char *name,
+	       void *buf,
+	       size_t size,
+	       unsigned long tag) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+uring_submit(URING *up,
+	     unsigned int wait) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+uring_complete(URING *up,
+	       unsigned long *tagp,
+	       int *resp) {
+  return 0;
+}
+
+int
+uring_drain(URING *up) {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * uring.h
+ *
+ * Copyright (c) 2019-2020, Peter Eriksson <pen@lysator.liu.se>
+ *
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef ACLTOOL_URING_H
+#define ACLTOOL_URING_H 1
+
+#include <sys/types.h>
+
+/*
+ * Minimal io_uring wrapper (Linux) used to submit batches of metadata
+ * operations (statx, getxattr) with a single system call. All functions
+ * fail with ENOSYS if io_uring is not available.
+ */
+
+#define URING_OP_STATX    0
+#define URING_OP_GETXATTR 1
+
+typedef struct uring URING;
+
+extern URING *
+uring_new(unsigned int entries);
+
+extern void
+uring_free(URING *up);
+
+extern int
+uring_supported(URING *up,
+		int op);
+
+extern unsigned int
+uring_space(URING *up);
+
+extern int
+uring_statx(URING *up,
+	    int dirfd,
+	    const char *path,
+	    int flags,
+	    unsigned int mask,
+	    void *stxbuf,
+	    unsigned long tag);
+
+extern int
+uring_getxattr(URING *up,
+	       const char *path,
+	       const char *name,
+	       void *buf,
+	       size_t size,
+	       unsigned long tag);
+
+extern int
+uring_submit(URING *up,
+	     unsigned int wait);
+
+extern int
+uring_complete(URING *up,
+	       unsigned long *tagp,
+	       int *resp);
+
+extern int
+uring_drain(URING *up);
+
+#endif
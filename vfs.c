@@ -37,10 +37,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
+#if HAVE_STRUCT_STATFS_F_FSTYPENAME
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
 
 #if defined(__linux__)
 #include <sys/xattr.h>
+#include <sys/syscall.h>
 #elif defined(__FreeBSD__)
 #include <sys/extattr.h>
 #elif defined(__APPLE__)
@@ -61,8 +77,185 @@
 #include "smb.h"
 #endif
 
+#include "uring.h"
+
+#if defined(__linux__) && HAVE_LINUX_IO_URING_H
+#include <linux/stat.h>
+#include "gacl_impl.h"
+
+#define VFS_IO_URING 1
+#endif
+
 static char *cwd = NULL;
 
+/*
+ * Directory fd and name for the object the tree walker is currently
+ * visiting, so operations on that path can avoid a full path lookup.
+ */
+static __thread struct {
+  const char *path;
+  int fd;
+  const char *name;
+  GACL *acl;		/* Prefetched ACL, if any */
+  GACL_TYPE type;
+} vfs_at = { NULL, -1, NULL, NULL, 0 };
+
+
+void
+vfs_at_set(const char *path,
+	   int fd,
+	   const char *name) {
+  vfs_at.path = path;
+  vfs_at.fd = fd;
+  vfs_at.name = name;
+}
+
+/* Hand over an already read ACL for the current object */
+void
+vfs_at_set_acl(GACL *ap,
+	       GACL_TYPE type) {
+  if (vfs_at.acl)
+    gacl_free(vfs_at.acl);
+  vfs_at.acl = ap;
+  vfs_at.type = type;
+}
+
+void
+vfs_at_clear(void) {
+  vfs_at.path = NULL;
+  vfs_at.fd = -1;
+  vfs_at.name = NULL;
+  if (vfs_at.acl) {
+    gacl_free(vfs_at.acl);
+    vfs_at.acl = NULL;
+  }
+}
+
+static const char *
+_vfs_at(const char *path,
+	int *fdp) {
+  if (!vfs_at.path || !path ||
+      (path != vfs_at.path && strcmp(path, vfs_at.path) != 0))
+    return NULL;
+
+  *fdp = vfs_at.fd;
+  return vfs_at.name;
+}
+
+
+/*
+ * Operation rate limits (--max-ops-per-sec and --max-writes-per-sec).
+ * Token buckets that hold at most 1/10 second worth of operations. A
+ * caller that finds a bucket empty takes its tokens anyway (the bucket
+ * goes negative) and sleeps until they would have been there, so
+ * concurrent callers are served in order without busy waiting.
+ */
+typedef struct vfs_bucket {
+  double rate;		/* Operations per second, 0 = unlimited */
+  double burst;
+  double tokens;
+} VFS_BUCKET;
+
+static struct {
+#if HAVE_PTHREAD_H
+  pthread_mutex_t mtx;
+#endif
+  int f_on;
+  struct timespec t;
+  VFS_BUCKET ops;
+  VFS_BUCKET writes;
+} vfs_rl = {
+#if HAVE_PTHREAD_H
+  PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+
+static void
+_vfs_bucket_init(VFS_BUCKET *bp,
+		 unsigned int rate) {
+  bp->rate = rate;
+  bp->burst = (rate >= 10 ? rate/10.0 : 1.0);
+  bp->tokens = bp->burst;
+}
+
+/* Returns the number of seconds to wait for n tokens */
+static double
+_vfs_bucket_take(VFS_BUCKET *bp,
+		 double dt,
+		 unsigned int n) {
+  if (!bp->rate)
+    return 0;
+
+  bp->tokens += dt*bp->rate;
+  if (bp->tokens > bp->burst)
+    bp->tokens = bp->burst;
+
+  bp->tokens -= n;
+  return bp->tokens < 0 ? -bp->tokens/bp->rate : 0;
+}
+
+void
+vfs_rate_limit(unsigned int ops,
+	       unsigned int writes) {
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&vfs_rl.mtx);
+#endif
+  _vfs_bucket_init(&vfs_rl.ops, ops);
+  _vfs_bucket_init(&vfs_rl.writes, writes);
+  clock_gettime(CLOCK_MONOTONIC, &vfs_rl.t);
+  vfs_rl.f_on = (ops || writes);
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&vfs_rl.mtx);
+#endif
+}
+
+/* Microseconds this thread has spent waiting in vfs_throttle() */
+static __thread long vfs_rl_slept = 0;
+
+long
+vfs_throttle_slept(void) {
+  return vfs_rl_slept;
+}
+
+/* Account for n metadata operations (writes if f_write), waiting if needed */
+void
+vfs_throttle(int f_write,
+	     unsigned int n) {
+  struct timespec now, ts;
+  double dt, w, ww;
+
+
+  if (!vfs_rl.f_on)
+    return;
+
+#if HAVE_PTHREAD_H
+  pthread_mutex_lock(&vfs_rl.mtx);
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  dt = (now.tv_sec - vfs_rl.t.tv_sec) + (now.tv_nsec - vfs_rl.t.tv_nsec)/1e9;
+  vfs_rl.t = now;
+
+  w = _vfs_bucket_take(&vfs_rl.ops, dt, n);
+  if (f_write) {
+    ww = _vfs_bucket_take(&vfs_rl.writes, dt, n);
+    if (ww > w)
+      w = ww;
+  } else
+    (void) _vfs_bucket_take(&vfs_rl.writes, dt, 0);
+#if HAVE_PTHREAD_H
+  pthread_mutex_unlock(&vfs_rl.mtx);
+#endif
+
+  if (w > 0) {
+    ts.tv_sec = (time_t) w;
+    ts.tv_nsec = (long) ((w - ts.tv_sec)*1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+    vfs_rl_slept += (long) (w*1e6);
+  }
+}
+
 
 VFS_TYPE
 vfs_get_type(const char *path) {
@@ -223,6 +416,7 @@ vfs_lstat(const char *path,
 #endif
 
   memset(sp, 0, sizeof(*sp));
+  vfs_throttle(0, 1);
   switch (vfs_get_type(path)) {
 #if HAVE_LIBSMBCLIENT
   case VFS_TYPE_SMB:
@@ -235,6 +429,15 @@ vfs_lstat(const char *path,
   case VFS_TYPE_SYS:
     if (!path || !*path)
       path = ".";
+#if HAVE_FSTATAT
+    {
+      const char *name;
+      int fd;
+      
+      if ((name = _vfs_at(path, &fd)) != NULL)
+	return fstatat(fd, name, sp, AT_SYMLINK_NOFOLLOW);
+    }
+#endif
     return lstat(path, sp);
 
   default:
@@ -244,6 +447,229 @@ vfs_lstat(const char *path,
 }
 
 
+int
+vfs_lstatat(int fd,
+	    const char *name,
+	    struct stat *sp) {
+#if HAVE_FSTATAT
+  memset(sp, 0, sizeof(*sp));
+  vfs_throttle(0, 1);
+  return fstatat(fd, name, sp, AT_SYMLINK_NOFOLLOW);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+#if VFS_IO_URING
+
+#define VFS_IO_DEPTH 128	/* Operations per submit */
+#define VFS_IO_XSIZE 4096	/* ACL buffer size, larger ones use getxattr() */
+#define VFS_IO_PSIZE (NAME_MAX+32)
+
+struct vfs_io {
+  URING *up;
+  int f_acl;			/* Try getxattr */
+  int f_noacl;
+  dev_t noacl_dev;		/* Filesystem without NFSv4 ACLs */
+  struct statx stx[VFS_IO_DEPTH];
+  char path[VFS_IO_DEPTH][VFS_IO_PSIZE];
+  char xbuf[VFS_IO_DEPTH][VFS_IO_XSIZE];
+};
+
+
+VFS_IO *
+vfs_io_new(void) {
+  VFS_IO *iop;
+
+
+  iop = calloc(1, sizeof(*iop));
+  if (!iop)
+    return NULL;
+
+  iop->up = uring_new(VFS_IO_DEPTH);
+  if (!iop->up) {
+    free(iop);
+    return NULL;
+  }
+
+  iop->f_acl = uring_supported(iop->up, URING_OP_GETXATTR);
+  return iop;
+}
+
+void
+vfs_io_free(VFS_IO *iop) {
+  if (!iop)
+    return;
+
+  /* Operations in flight may still write into stx[] and xbuf[] */
+  if (uring_drain(iop->up) < 0)
+    return;	/* Leak it rather than free buffers in use */
+
+  uring_free(iop->up);
+  free(iop);
+}
+
+
+static void
+_vfs_statx2stat(const struct statx *xp,
+		struct stat *sp) {
+  memset(sp, 0, sizeof(*sp));
+  sp->st_dev = makedev(xp->stx_dev_major, xp->stx_dev_minor);
+  sp->st_ino = xp->stx_ino;
+  sp->st_mode = xp->stx_mode;
+  sp->st_nlink = xp->stx_nlink;
+  sp->st_uid = xp->stx_uid;
+  sp->st_gid = xp->stx_gid;
+  sp->st_rdev = makedev(xp->stx_rdev_major, xp->stx_rdev_minor);
+  sp->st_size = xp->stx_size;
+  sp->st_blksize = xp->stx_blksize;
+  sp->st_blocks = xp->stx_blocks;
+  sp->st_atim.tv_sec = xp->stx_atime.tv_sec;
+  sp->st_atim.tv_nsec = xp->stx_atime.tv_nsec;
+  sp->st_mtim.tv_sec = xp->stx_mtime.tv_sec;
+  sp->st_mtim.tv_nsec = xp->stx_mtime.tv_nsec;
+  sp->st_ctim.tv_sec = xp->stx_ctime.tv_sec;
+  sp->st_ctim.tv_nsec = xp->stx_ctime.tv_nsec;
+}
+
+/* Submit the prepared operations and collect all 'n' results */
+static int
+_vfs_io_run(VFS_IO *iop,
+	    size_t n,
+	    size_t base,
+	    int *resv) {
+  unsigned long tag;
+  int res;
+
+
+  if (uring_submit(iop->up, n) < 0)
+    return -1;
+
+  while (n > 0) {
+    if (!uring_complete(iop->up, &tag, &res)) {
+      if (uring_submit(iop->up, n) < 0)
+	return -1;
+      continue;
+    }
+    resv[tag-base] = res;
+    n--;
+  }
+
+  return 0;
+}
+
+int
+vfs_io_meta(VFS_IO *iop,
+	    int fd,
+	    VFS_META *v,
+	    size_t n,
+	    mode_t acltypes,
+	    int (*skipacl)(const struct stat *sp)) {
+  int resv[VFS_IO_DEPTH];
+  size_t i, j, k, nj;
+
+
+  for (i = 0; i < n; i++) {
+    v[i].rc = -1;
+    v[i].acl = NULL;
+  }
+
+  for (i = 0; i < n; i += VFS_IO_DEPTH) {
+    nj = (n-i < VFS_IO_DEPTH ? n-i : VFS_IO_DEPTH);
+
+    /* Pass 1: statx() */
+    for (k = 0, j = 0; j < nj; j++) {
+      if (!v[i+j].name)
+	continue;
+      if (uring_statx(iop->up, fd, v[i+j].name, AT_SYMLINK_NOFOLLOW,
+		      STATX_BASIC_STATS, &iop->stx[j], i+j) < 0)
+	return -1;
+      k++;
+    }
+    vfs_throttle(0, k);
+    if (k > 0 && _vfs_io_run(iop, k, i, resv) < 0)
+      return -1;
+
+    /* Pass 2: getxattr() for the objects that might have an ACL */
+    for (k = 0, j = 0; j < nj; j++) {
+      VFS_META *mp = &v[i+j];
+      int rc;
+
+      if (!mp->name)
+	continue;
+
+      if (resv[j] < 0)
+	continue;
+      _vfs_statx2stat(&iop->stx[j], &mp->stat);
+      mp->rc = 0;
+
+      if (!iop->f_acl ||
+	  (iop->f_noacl && mp->stat.st_dev == iop->noacl_dev) ||
+	  S_ISDIR(mp->stat.st_mode) || S_ISLNK(mp->stat.st_mode) ||
+	  (acltypes && !(mp->stat.st_mode & acltypes)) ||
+	  (skipacl && skipacl(&mp->stat)))
+	continue;
+
+      rc = snprintf(iop->path[j], VFS_IO_PSIZE, "/proc/self/fd/%d/%s", fd, mp->name);
+      if (rc < 0 || rc >= VFS_IO_PSIZE)
+	continue;
+
+      if (uring_getxattr(iop->up, iop->path[j], ACL_NFS4_XATTR,
+			 iop->xbuf[j], VFS_IO_XSIZE, i+j) < 0)
+	return -1;
+      k++;
+    }
+    if (k == 0)
+      continue;
+
+    vfs_throttle(0, k);
+    for (j = 0; j < nj; j++)
+      resv[j] = -ENOENT;
+    if (_vfs_io_run(iop, k, i, resv) < 0)
+      return -1;
+
+    for (j = 0; j < nj; j++) {
+      if (resv[j] > 0)
+	v[i+j].acl = _gacl_init_from_nfs4(iop->xbuf[j], resv[j]);
+      else if (resv[j] == -EOPNOTSUPP || resv[j] == -ENOTSUP) {
+	/* Not an NFSv4 ACL capable filesystem, no point in trying again */
+	iop->f_noacl = 1;
+	iop->noacl_dev = v[i+j].stat.st_dev;
+      }
+    }
+  }
+
+  return 0;
+}
+
+#else
+
+VFS_IO *
+vfs_io_new(void) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+void
+vfs_io_free(VFS_IO *iop) {
+}
+
+int
+vfs_io_meta(VFS_IO *iop,
+	    int fd,
+	    VFS_META *v,
+	    size_t n,
+	    mode_t acltypes,
+	    int (*skipacl)(const struct stat *sp)) {
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+
 int
 vfs_statvfs(const char *path,
 	    struct statvfs *sp) {
@@ -272,6 +698,83 @@ vfs_statvfs(const char *path,
 }
 
 
+/*
+ * Get the name of the filesystem type (like "nfs" or "zfs") that the
+ * object 'path' (with stat data 'sp') lives on.
+ */
+int
+vfs_fstype(const char *path,
+	   const struct stat *sp,
+	   char *buf,
+	   size_t size) {
+#if defined(__linux__)
+  FILE *fp;
+  char line[4096], *cp;
+  unsigned int ma, mi;
+  int rc = -1;
+#elif HAVE_STRUCT_STATVFS_F_BASETYPE
+  struct statvfs vb;
+#elif HAVE_STRUCT_STATFS_F_FSTYPENAME
+  struct statfs fb;
+#endif
+
+
+  if (vfs_get_type(path) != VFS_TYPE_SYS) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+#if defined(__linux__)
+  /* statvfs() has no type name here, look up the device in mountinfo */
+  fp = fopen("/proc/self/mountinfo", "r");
+  if (!fp)
+    return -1;
+
+  errno = ENOENT;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%*d %*d %u:%u", &ma, &mi) != 2 ||
+	ma != major(sp->st_dev) || mi != minor(sp->st_dev))
+      continue;
+    cp = strstr(line, " - ");
+    if (!cp)
+      continue;
+    cp += 3;
+    cp[strcspn(cp, " \n")] = '\0';
+    if (strlen(cp) >= size) {
+      errno = ERANGE;
+      break;
+    }
+    strcpy(buf, cp);
+    rc = 0;
+    break;
+  }
+  fclose(fp);
+  return rc;
+#elif HAVE_STRUCT_STATVFS_F_BASETYPE
+  if (statvfs(path, &vb) < 0)
+    return -1;
+  if (strlen(vb.f_basetype) >= size) {
+    errno = ERANGE;
+    return -1;
+  }
+  strcpy(buf, vb.f_basetype);
+  return 0;
+#elif HAVE_STRUCT_STATFS_F_FSTYPENAME
+  if (statfs(path, &fb) < 0)
+    return -1;
+  if (strlen(fb.f_fstypename) >= size) {
+    errno = ERANGE;
+    return -1;
+  }
+  strcpy(buf, fb.f_fstypename);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
 
 VFS_DIR *
 vfs_opendir(const char *path) {
@@ -304,6 +807,7 @@ vfs_opendir(const char *path) {
     
     vdp->type = VFS_TYPE_SYS;
     vdp->dh.sys = dh;
+    memset(&vdp->batch, 0, sizeof(vdp->batch));
     return vdp;
 
     default:
@@ -313,6 +817,61 @@ vfs_opendir(const char *path) {
 }
 
 
+/* Open a subdirectory relative to an already open directory */
+VFS_DIR *
+vfs_opendirat(VFS_DIR *pdp,
+	      const char *name) {
+#if HAVE_OPENAT && HAVE_FDOPENDIR
+  VFS_DIR *vdp;
+  DIR *dh;
+  int fd;
+
+  
+  if (pdp->type != VFS_TYPE_SYS) {
+    errno = ENOSYS;
+    return NULL;
+  }
+
+  fd = openat(dirfd(pdp->dh.sys), name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  dh = fdopendir(fd);
+  if (!dh) {
+    close(fd);
+    return NULL;
+  }
+  
+  vdp = malloc(sizeof(*vdp));
+  if (!vdp) {
+    closedir(dh);
+    return NULL;
+  }
+  
+  vdp->type = VFS_TYPE_SYS;
+  vdp->dh.sys = dh;
+  memset(&vdp->batch, 0, sizeof(vdp->batch));
+  return vdp;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+
+/* Returns a file descriptor usable with the *at() calls, or -1 */
+int
+vfs_dirfd(VFS_DIR *vdp) {
+#if HAVE_OPENAT && HAVE_FDOPENDIR && HAVE_FSTATAT
+  if (vdp->type == VFS_TYPE_SYS)
+    return dirfd(vdp->dh.sys);
+#endif
+
+  errno = ENOSYS;
+  return -1;
+}
+
+
 struct dirent *
 vfs_readdir(VFS_DIR *vdp) {
   switch (vdp->type) {
@@ -331,10 +890,173 @@ vfs_readdir(VFS_DIR *vdp) {
 }
 
 
+/*
+ * Convert a DT_xxx type to S_IFxxx
+ */
+static mode_t
+_vfs_dtype(int d_type) {
+#if defined(DTTOIF)
+  if (d_type != DT_UNKNOWN)
+    return DTTOIF(d_type);
+#endif
+  return 0;
+}
+
+
+#if defined(__linux__) && defined(SYS_getdents64)
+#define VFS_GETDENTS_MINSIZE (8*1024)
+#define VFS_GETDENTS_BUFSIZE (128*1024)
+
+struct vfs_linux_dirent64 {
+  u_int64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/*
+ * Drain the directory straight from getdents64() into a buffer, one
+ * system call per buffer instead of going through readdir(). The buffer
+ * starts small and grows for large directories, and is released at the
+ * end of the directory since the walkers keep directories open while
+ * descending into their subdirectories.
+ */
+static int
+_vfs_readdir_batch_getdents(VFS_DIR *vdp,
+			    VFS_DIRENT *v,
+			    int n) {
+  int i;
+
+  
+  if (vdp->batch.pos >= vdp->batch.len) {
+    long rc;
+
+    if (!vdp->batch.buf ||
+	(vdp->batch.len > vdp->batch.size/2 && vdp->batch.size < VFS_GETDENTS_BUFSIZE)) {
+      size_t ns = (vdp->batch.buf ? vdp->batch.size*2 : VFS_GETDENTS_MINSIZE);
+
+      /* Everything in it has been used, so no need to copy it */
+      free(vdp->batch.buf);
+      vdp->batch.size = vdp->batch.len = 0;
+      vdp->batch.buf = malloc(ns);
+      if (!vdp->batch.buf)
+	return -1;
+      vdp->batch.size = ns;
+    }
+    
+    rc = syscall(SYS_getdents64, dirfd(vdp->dh.sys), vdp->batch.buf, vdp->batch.size);
+    if (rc <= 0) {
+      if (rc == 0) {
+	free(vdp->batch.buf);
+	vdp->batch.buf = NULL;
+	vdp->batch.size = vdp->batch.len = vdp->batch.pos = 0;
+      }
+      return rc;
+    }
+    
+    vdp->batch.len = rc;
+    vdp->batch.pos = 0;
+  }
+
+  for (i = 0; i < n && vdp->batch.pos < vdp->batch.len; i++) {
+    struct vfs_linux_dirent64 *dep = (struct vfs_linux_dirent64 *) (vdp->batch.buf + vdp->batch.pos);
+
+    v[i].d_ino = dep->d_ino;
+    v[i].d_type = _vfs_dtype(dep->d_type);
+    v[i].d_name = dep->d_name;
+    vdp->batch.pos += dep->d_reclen;
+  }
+
+  return i;
+}
+#endif
+
+
+/*
+ * Generic version on top of vfs_readdir(), names are copied
+ * since the dirent may be overwritten by the next call.
+ */
+static int
+_vfs_readdir_batch_copy(VFS_DIR *vdp,
+			VFS_DIRENT *v,
+			int n) {
+  struct dirent *dep;
+  int i;
+
+  
+  vdp->batch.len = 0;
+  
+  for (i = 0; i < n && (dep = vfs_readdir(vdp)) != NULL; i++) {
+    size_t nlen = strlen(dep->d_name)+1;
+
+    if (vdp->batch.len+nlen > vdp->batch.size) {
+      size_t ns = vdp->batch.size ? vdp->batch.size*2 : 8192;
+      char *nb;
+
+      while (vdp->batch.len+nlen > ns)
+	ns *= 2;
+      nb = realloc(vdp->batch.buf, ns);
+      if (!nb)
+	return -1;
+      vdp->batch.buf = nb;
+      vdp->batch.size = ns;
+    }
+
+    memcpy(vdp->batch.buf+vdp->batch.len, dep->d_name, nlen);
+#if HAVE_STRUCT_DIRENT_D_TYPE
+    v[i].d_type = _vfs_dtype(dep->d_type);
+#else
+    v[i].d_type = 0;
+#endif
+    v[i].d_ino = dep->d_ino;
+    /* Offset for now, the buffer may move */
+    v[i].d_name = (const char *) vdp->batch.len;
+    vdp->batch.len += nlen;
+
+#if HAVE_LIBSMBCLIENT
+    /* smb_readdir() returns a malloc'd dirent */
+    if (vdp->type == VFS_TYPE_SMB)
+      free(dep);
+#endif
+  }
+
+  for (n = 0; n < i; n++)
+    v[n].d_name = vdp->batch.buf + (size_t) v[n].d_name;
+  
+  return i;
+}
+
+
+int
+vfs_readdir_batch(VFS_DIR *vdp,
+		  VFS_DIRENT *v,
+		  int n) {
+  switch (vdp->type) {
+  case VFS_TYPE_SYS:
+#if defined(__linux__) && defined(SYS_getdents64)
+    return _vfs_readdir_batch_getdents(vdp, v, n);
+#endif
+    
+#if HAVE_LIBSMBCLIENT
+  case VFS_TYPE_SMB:
+#endif
+    return _vfs_readdir_batch_copy(vdp, v, n);
+    
+  default:
+    errno = ENOSYS;
+    return -1;
+  }
+}
+
+
 int
 vfs_closedir(VFS_DIR *vdp) {
   int rc;
 
+  free(vdp->batch.buf);
+  vdp->batch.buf = NULL;
+  
   switch (vdp->type) {
 #if HAVE_LIBSMBCLIENT
   case VFS_TYPE_SMB:
@@ -675,6 +1397,8 @@ vfs_removexattr(const char *path,
 GACL *
 vfs_acl_get_file(const char *path,
 		 GACL_TYPE type) {
+  const char *name;
+  int fd;
 #if HAVE_LIBSMBCLIENT
   char buf[2048];
 #endif
@@ -685,10 +1409,26 @@ vfs_acl_get_file(const char *path,
     if (!vfs_fullpath(path, buf, sizeof(buf)))
       return NULL;
     
+    vfs_throttle(0, 1);
     return smb_acl_get_file(buf);
 #endif
 
   case VFS_TYPE_SYS:
+    if ((name = _vfs_at(path, &fd)) != NULL) {
+      GACL *ap = vfs_at.acl;
+
+      if (ap && vfs_at.type == type) {
+	vfs_at.acl = NULL;
+	return ap;
+      }
+      
+      vfs_throttle(0, 1);
+      ap = gacl_get_fileat_np(fd, name, type, 0);
+      if (ap || errno != ENOSYS)
+	return ap;
+    }
+    else
+      vfs_throttle(0, 1);
     return gacl_get_file(path, type);
 
   default:
@@ -701,10 +1441,13 @@ vfs_acl_get_file(const char *path,
 GACL *
 vfs_acl_get_link(const char *path,
 		 GACL_TYPE type) {
+  const char *name;
+  int fd;
 #if HAVE_LIBSMBCLIENT
   char buf[2048];
 #endif
 
+  vfs_throttle(0, 1);
   switch (vfs_get_type(path)) {
 #if HAVE_LIBSMBCLIENT
   case VFS_TYPE_SMB:
@@ -716,6 +1459,12 @@ vfs_acl_get_link(const char *path,
 #endif
     
   case VFS_TYPE_SYS:
+    if ((name = _vfs_at(path, &fd)) != NULL) {
+      GACL *ap = gacl_get_fileat_np(fd, name, type, AT_SYMLINK_NOFOLLOW);
+
+      if (ap || errno != ENOSYS)
+	return ap;
+    }
     return gacl_get_link_np(path, type);
 
   default:
@@ -725,14 +1474,64 @@ vfs_acl_get_link(const char *path,
 }
 
 
+/*
+ * Returns 1 if the object already has the ACL, 0 if not. Compares the
+ * raw ACLs when possible (see gacl_encode_np()).
+ */
+int
+vfs_acl_match_file(const char *path,
+		   GACL_TYPE type,
+		   GACL *ap) {
+  const char *name;
+  GACL *oap;
+  int fd, rc;
+
+
+  switch (vfs_get_type(path)) {
+  case VFS_TYPE_SYS:
+    if ((name = _vfs_at(path, &fd)) != NULL) {
+      oap = vfs_at.acl;
+      if (oap && vfs_at.type == type) {
+	/* Already fetched, keep it for vfs_acl_get_file() if different */
+	rc = gacl_match(ap, oap);
+	if (rc == 1) {
+	  vfs_at.acl = NULL;
+	  gacl_free(oap);
+	}
+	return rc;
+      }
+
+      vfs_throttle(0, 1);
+      rc = gacl_match_fileat_np(fd, name, type, ap, 0);
+      if (rc >= 0 || errno != ENOSYS)
+	return rc;
+    }
+    else
+      vfs_throttle(0, 1);
+    return gacl_match_fileat_np(AT_FDCWD, path, type, ap, 0);
+
+  default:
+    oap = vfs_acl_get_file(path, type);
+    if (!oap)
+      return -1;
+    rc = gacl_match(ap, oap);
+    gacl_free(oap);
+    return rc;
+  }
+}
+
+
 int
 vfs_acl_set_file(const char *path,
 		 GACL_TYPE type,
 		 GACL *ap) {
+  const char *name;
+  int fd;
 #if HAVE_LIBSMBCLIENT
   char buf[2048];
 #endif
 
+  vfs_throttle(1, 1);
   switch (vfs_get_type(path)) {
 #if HAVE_LIBSMBCLIENT
   case VFS_TYPE_SMB:
@@ -743,6 +1542,16 @@ vfs_acl_set_file(const char *path,
 #endif
 
   case VFS_TYPE_SYS:
+    if ((name = _vfs_at(path, &fd)) != NULL) {
+      int rc;
+
+      /* A prefetched ACL would be stale after this */
+      vfs_at_set_acl(NULL, 0);
+      rc = gacl_set_fileat_np(fd, name, type, ap, 0);
+
+      if (rc >= 0 || errno != ENOSYS)
+	return rc;
+    }
     return gacl_set_file(path, type, ap);
 
   default:
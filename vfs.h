@@ -50,8 +50,21 @@ typedef struct {
     DIR *sys;
     int smb;
   } dh;
+  struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    size_t pos;
+  } batch;
 } VFS_DIR;
 
+/* Directory entry as returned by vfs_readdir_batch() */
+typedef struct vfs_dirent {
+  ino_t d_ino;
+  mode_t d_type;	/* S_IFxxx, or 0 if unknown */
+  const char *d_name;
+} VFS_DIRENT;
+
 extern VFS_TYPE
 vfs_get_type(const char *path);
 
@@ -67,23 +80,108 @@ vfs_fullpath(const char *path,
 	     char *buf,
 	     size_t bufsize);
 
+/* Limit the rate of metadata operations (0 = unlimited) */
+extern void
+vfs_rate_limit(unsigned int ops,
+	       unsigned int writes);
+
+extern void
+vfs_throttle(int f_write,
+	     unsigned int n);
+
+/* Total time (us) the calling thread has been delayed by vfs_throttle() */
+extern long
+vfs_throttle_slept(void);
+
 extern int
 vfs_lstat(const char *path,
 	  struct stat *sp);
 
+extern int
+vfs_lstatat(int fd,
+	    const char *name,
+	    struct stat *sp);
+
+/*
+ * Batched metadata lookups relative to a directory fd (io_uring on
+ * Linux). The caller sets the names (NULL entries are skipped) and gets
+ * the lstat() result and, for objects matching acltypes that are not
+ * directories or symlinks, the NFSv4 ACL if one could be read. Objects
+ * for which skipacl (if not NULL) returns nonzero get no ACL. Entries
+ * with rc < 0 (or acl == NULL) should be looked up the normal way.
+ */
+typedef struct vfs_meta {
+  const char *name;
+  int rc;		/* 0 = stat is valid */
+  struct stat stat;
+  GACL *acl;
+} VFS_META;
+
+typedef struct vfs_io VFS_IO;
+
+extern VFS_IO *
+vfs_io_new(void);
+
+extern void
+vfs_io_free(VFS_IO *iop);
+
+extern int
+vfs_io_meta(VFS_IO *iop,
+	    int fd,
+	    VFS_META *v,
+	    size_t n,
+	    mode_t acltypes,
+	    int (*skipacl)(const struct stat *sp));
+
 extern int
 vfs_statvfs(const char *path,
 	    struct statvfs *sp);
 
+extern int
+vfs_fstype(const char *path,
+	   const struct stat *sp,
+	   char *buf,
+	   size_t size);
+
 extern VFS_DIR *
 vfs_opendir(const char *path);
 
+extern VFS_DIR *
+vfs_opendirat(VFS_DIR *dp,
+	      const char *name);
+
+extern int
+vfs_dirfd(VFS_DIR *dp);
+
 extern struct dirent *
 vfs_readdir(VFS_DIR *dp);
 
+/*
+ * Read up to n entries (including . and ..) at once. Returns the number
+ * of entries, 0 at the end of the directory or -1 on error. The names are
+ * valid until the next call. Do not mix with vfs_readdir() on the same dp.
+ */
+extern int
+vfs_readdir_batch(VFS_DIR *dp,
+		  VFS_DIRENT *v,
+		  int n);
+
 extern int
 vfs_closedir(VFS_DIR *dp);
 
+/* Tell the vfs layer that path is name relative to the directory fd */
+extern void
+vfs_at_set(const char *path,
+	   int fd,
+	   const char *name);
+
+extern void
+vfs_at_set_acl(GACL *ap,
+	       GACL_TYPE type);
+
+extern void
+vfs_at_clear(void);
+
 extern GACL *
 vfs_acl_get_file(const char *path,
 		 GACL_TYPE type);
@@ -92,6 +190,11 @@ extern GACL *
 vfs_acl_get_link(const char *path,
 		 GACL_TYPE type);
 
+extern int
+vfs_acl_match_file(const char *path,
+		   GACL_TYPE type,
+		   GACL *ap);
+
 extern int
 vfs_acl_set_file(const char *path,
 		 GACL_TYPE type,